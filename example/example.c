@@ -17,6 +17,8 @@ static inline void bind_to_cpu(int cpu) {
 struct bonsai_config {
     int nr_user_cpus;
     int *user_cpus;
+    int stm_support;
+    const char *index;
 };
 
 void *kv_create_context(void *config);
@@ -32,7 +34,7 @@ int kv_del(void *tcontext, void *key, size_t key_len);
 int kv_get(void *tcontext, void *key, size_t key_len, void *val, size_t *val_len);
 
 int main() {
-    struct bonsai_config cfg = { 1, (int []) { 0 } };
+    struct bonsai_config cfg = { 1, (int []) { 0 }, 0, "masstree" };
     void *context, *thread_context;
     char value[8];
     size_t len;
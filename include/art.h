@@ -0,0 +1,41 @@
+#ifndef __ART_H
+#define __ART_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/* Long enough for pkey_t, in both 8B and 24B builds */
+#define ART_MAX_KEY_LEN     24
+
+struct art;
+typedef struct art art_t;
+
+typedef struct {
+    void *(*alloc)(size_t);
+    void  (*free)(void *, size_t);
+} art_ops_t;
+
+extern art_t *art_create(const art_ops_t *ops);
+extern void art_destroy(art_t *tree);
+
+/* Obsolete nodes and removed leaves, freed in two steps like masstree_gc. */
+extern void *art_gc_prepare(art_t *tree, size_t *bytes);
+extern size_t art_gc(art_t *tree, void *gc);
+
+/*
+ * All the keys in a tree have the same length, compared bytewise. art_get
+ * returns the value of the largest key <= @key, and copies that key to
+ * @actual_key if not NULL.
+ */
+extern void *art_get(art_t *tree, const void *key, size_t len, void *actual_key);
+extern int art_put(art_t *tree, const void *key, size_t len, void *val);
+extern int art_del(art_t *tree, const void *key, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -29,8 +29,10 @@ extern "C" {
 
 struct bonsai_desc {
 	__le32 init;
-	__le32 padding;
+	__le32 pnode_sentinel; /* head of the persistent pnode list */
 	__le64 epoch;
+	__le32 pnode_hwm; /* pnodes at or above it were never allocated */
+	__le32 padding;
 	struct log_region_desc log_region[NUM_CPU];
 	char log_region_fpath[NUM_SOCKET][REGION_FPATH_LEN];
 }__packed;
@@ -60,7 +62,7 @@ struct bonsai_info {
 	struct thread_info *user_threads[NUM_USER_THREAD];
 
     /* smo */
-	struct thread_info *smo;
+	struct thread_info *smo[NUM_SMO_THREAD];
 
     /* RCU */
     rcu_t rcu;
@@ -176,12 +178,35 @@ static inline int oplog_cmp(const struct oplog *a, const struct oplog *b) {
     return pkey_compare(a->o_kv.k, b->o_kv.k) ? : (a->o_stamp == b->o_stamp ? 0 : (a->o_stamp < b->o_stamp ? -1 : 1));
 }
 
+static inline uint64_t pkey_prefix(pkey_t k) {
+#ifdef STR_KEY
+    /* Big endian, so that it compares like memcmp. */
+    return __builtin_bswap64(*(uint64_t *) k.key);
+#else
+    return *(uint64_t *) k.key;
+#endif
+}
+
+static inline int oplog_ref_cmp(const struct oplog_ref *a, const struct oplog_ref *b) {
+    if (a->kprefix != b->kprefix) {
+        return a->kprefix < b->kprefix ? -1 : 1;
+    }
+#ifdef STR_KEY
+    /* Same prefix, look at the logs. */
+    return pkey_compare(a->log->o_kv.k, b->log->o_kv.k) ? : (a->stamp == b->stamp ? 0 : (a->stamp < b->stamp ? -1 : 1));
+#else
+    return a->stamp == b->stamp ? 0 : (a->stamp < b->stamp ? -1 : 1);
+#endif
+}
+
 extern int bonsai_init(char* index_name, init_func_t init, destory_func_t destory,
 				insert_func_t insert, update_func_t update, remove_func_t remove,
 				lookup_func_t lookup, scan_func_t scan);
 extern void bonsai_deinit();
+extern void bonsai_set_index_gc(gc_prepare_func_t prepare, gc_func_t gc);
 
 extern void bonsai_recover();
+extern void index_image_dump();
 
 extern void index_layer_dump();
 
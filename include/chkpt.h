@@ -0,0 +1,69 @@
+#ifndef __CHKPT_H
+#define __CHKPT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "config.h"
+#include "thread.h"
+
+/* The master looks at the store this often, even if nobody wakes it up. */
+#define CHKPT_POLL_TIME         10000   /* us */
+
+/* Limits of the trigger, which grows with the write rate during bursts */
+#define CHKPT_MIN_NLOG          (CHKPT_NLOG_INTERVAL / 4)
+#define CHKPT_MAX_NLOG          (CHKPT_NLOG_INTERVAL * 64)
+#define CHKPT_BATCH_POLLS       8
+
+/* Checkpoint before admission control steps in, see LOG_LOW_WMARK */
+#define CHKPT_MAX_CPU_NLOG      (NUM_OPLOG_PER_CPU / 4)
+
+/* Inodes allocated since the last checkpoint, in bytes */
+#define CHKPT_INODE_MEM         (NUM_CPU * CPU_INODE_POOL_SIZE / 8)
+
+/* Reads hitting the logs rather than the pnodes, out of at least CHKPT_MIN_READS */
+#define CHKPT_LOG_HIT_PCT       50
+#define CHKPT_MIN_READS         1000
+
+/* Idle: fewer ops than this per poll, for some polls in a row */
+#define CHKPT_IDLE_OPS          100
+#define CHKPT_IDLE_POLLS        3
+
+enum chkpt_reason {
+    CHKPT_NONE = 0,
+    CHKPT_FORCED,       /* asked by admission control or bonsai_flush */
+    CHKPT_NLOG,         /* the backlog reached the trigger */
+    CHKPT_OCCUPANCY,    /* a log region is filling up */
+    CHKPT_INODE,        /* the inodes take too much DRAM */
+    CHKPT_READS,        /* reads keep going to the logs */
+    CHKPT_IDLE,         /* nobody is using the store */
+    CHKPT_AGE,          /* the logs waited for CHKPT_TIME_INTERVAL */
+    NR_CHKPT_REASON
+};
+
+struct chkpt_stat {
+    unsigned long nr_chkpt[NR_CHKPT_REASON];
+    unsigned long nr_poll;
+    unsigned long nr_deferred;  /* decisions not to checkpoint some backlog */
+    int trigger_nlog;
+    unsigned log_hit_pct;       /* of the last poll */
+    int idle;
+};
+
+/* Users wake up the master when their share of the backlog reaches this. */
+extern int chkpt_trigger_nlog;
+
+extern long chkpt_poll_time();
+extern enum chkpt_reason chkpt_decide(int timeout);
+extern void chkpt_done();
+
+extern const char *chkpt_reason_str(enum chkpt_reason reason);
+extern void chkpt_stat(struct chkpt_stat *stat);
+extern void chkpt_dump_stat();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,9 +23,19 @@ extern "C" {
 //#define ENABLE_PNODE_REPLICA
 //#define REPLICA_EPOCH_INTERVAL  1                               /* seconds */
 
+//#define ENABLE_INDEX_IMAGE                                    /* for restarts after a clean shutdown */
+//#define LAZY_RECOVERY
+
 //#define ASYNC_SMO
+//#define OPTIMISTIC_UPSERT
+
+//#define OPLOG_COMPRESSION
+//#define ZERO_COPY_FETCH
 
 #define ENABLE_AUTO_CHKPT
+//#define ADAPTIVE_CHKPT
+//#define FLUSH_QOS
+#define QOS_P99_TARGET          5000                            /* ns */
 #define ENABLE_LOAD_BALANCE
 
 //#define STR_KEY
@@ -9,6 +9,8 @@ struct counter {
     int nr_ino;
     int nr_pno;
     size_t index_mem;
+    size_t index_retired, index_freed;      /* bytes of unlinked index nodes, see @index_layer_gc */
+    unsigned long nr_log_hit, nr_pnode_hit; /* where shim lookups find the keys */
 } ____cacheline_aligned;
 
 extern struct counter counters[];
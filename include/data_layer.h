@@ -37,6 +37,14 @@ struct data_layer {
 
     pnoid_t sentinel;
 
+    /* DRAM copy of the persistent pnode high water mark. */
+    pnoid_t hwm;
+    spinlock_t hwm_lock;
+
+    /* The persistent pnode list in order, collected at recovery. */
+    pnoid_t *rebuild_pnos;
+    int nr_rebuild_pno;
+
     /* Protect the pnode list. */
 	spinlock_t plist_lock;
 
@@ -186,6 +194,8 @@ static inline int pnode_color(pnoid_t pno) {
 }
 
 pnoid_t pnode_sentinel_init();
+pnoid_t pnode_recover(pnoid_t *pnos, int nr_pno);
+void pnode_restore(pnoid_t pnode, pnoid_t prev);
 
 void pnode_split_and_recolor(pnoid_t *pnode, pnoid_t *sibling, pkey_t *cut, int lc, int rc);
 void pnode_run_batch(log_state_t *lst, pnoid_t pnode, struct list_head *pbatch_list, void *rec);
@@ -196,6 +206,7 @@ pkey_t pnode_get_rfence(pnoid_t pnode);
 void pnode_prefetch_meta(pnoid_t pnode);
 int pnode_lookup(pnoid_t pnode, pkey_t key, pval_t *val);
 int pnode_snapshot(pnoid_t pnode, pentry_t *entries, pval_t *values);
+int pnode_version(pnoid_t pnode);
 int is_in_pnode(pnoid_t pnode, pkey_t key);
 
 void pnode_recycle();
@@ -218,7 +229,7 @@ static inline void end_invalidate_unref_entries(const unsigned *since) {}
 
 struct data_layer;
 
-int data_layer_init(struct data_layer *layer);
+int data_layer_init(struct data_layer *layer, int format);
 void data_layer_deinit(struct data_layer* layer);
 
 #ifdef __cplusplus
@@ -6,12 +6,18 @@ extern "C" {
 #endif
 
 #include "kfifo.h"
+#include "thread.h"
 #include "data_layer.h"
 
 #define INODE_SIZE								sizeof(inode_t)
 #define CPU_TOTAL_INODE                         (CPU_INODE_POOL_SIZE / INODE_SIZE)
 
 #define SMO_LOG_QUEUE_CAPACITY_PER_THREAD       2048
+/* Pnodes per range rebuilt at a time after restart, see @shim_rebuild_init */
+#define REBUILD_RANGE_NR_PNODE                  8
+
+/* SMOs a thread holds back till it's done with the shim, see @smo_flush */
+#define SMO_BATCH_SIZE                          32
 
 typedef void* (*init_func_t)(void);
 typedef void (*destory_func_t)(void*);
@@ -20,6 +26,8 @@ typedef int (*update_func_t)(void* index_struct, const void *key, size_t len, co
 typedef int (*remove_func_t)(void* index_struct, const void *key, size_t len);
 typedef void* (*lookup_func_t)(void* index_struct, const void *key, size_t len, const void *actual_key);
 typedef int (*scan_func_t)(void* index_struct, const void *low, const void *high);
+typedef void* (*gc_prepare_func_t)(void* index_struct, size_t *bytes);
+typedef size_t (*gc_func_t)(void* index_struct, void *gc);
 
 struct index_layer {
 	void *index_struct;
@@ -31,6 +39,11 @@ struct index_layer {
 	scan_func_t   scan;
 
 	destory_func_t destory;
+
+	/* Optional: reclaim the nodes unlinked by the index, see @index_layer_gc. */
+	gc_prepare_func_t gc_prepare;
+	gc_func_t         gc;
+	void             *gc_pending;
 };
 
 struct inode;
@@ -41,6 +54,11 @@ struct smo_log {
     void *v;
 };
 
+/* The oldest SMO a producer holds back, ULONG_MAX if none */
+struct smo_wmark {
+    unsigned long ts;
+} ____cacheline_aligned;
+
 struct inode_pool {
     void *start;
     struct inode *freelist;
@@ -49,20 +67,45 @@ struct inode_pool {
 struct shim_layer {
     atomic_t exit;
 
-    DECLARE_KFIFO(fifo, struct smo_log, SMO_LOG_QUEUE_CAPACITY_PER_THREAD)[NUM_CPU];
+    /* Per SMO thread, which takes a hash partition of the keys, per producer */
+    DECLARE_KFIFO(fifo, struct smo_log, SMO_LOG_QUEUE_CAPACITY_PER_THREAD)[NUM_SMO_THREAD][NUM_CPU];
+    struct smo_wmark wmark[NUM_CPU];
 
     struct inode      *head;
     struct inode_pool *pool;
 };
 
+/* See @shim_lookup_version. */
+struct key_version {
+    uint64_t stamp;
+    pnoid_t  pno;
+    int      pver;
+};
+
+static inline int key_version_equal(const struct key_version *a, const struct key_version *b) {
+    return a->stamp == b->stamp && a->pno == b->pno && a->pver == b->pver;
+}
+
+/* An update of a write batch, see @bonsai_write_batch. */
+struct batch_ent {
+    pentry_t ent;
+    optype_t op;
+};
+
 struct log_info {
     struct oplog *oplog;
     unsigned pos;
 };
 
 int shim_sentinel_init(pnoid_t sentinel_pnoid);
+void shim_rebuild_init(const pnoid_t *pnos, const pkey_t *lfences, int nr);
+void shim_rebuild_range(int wid);
 int shim_upsert(log_state_t *lst, pkey_t key, logid_t log);
+int shim_upsert_batch(log_state_t *lst, const pentry_t *ents, const logid_t *logs, int n);
+int sort_batch(pentry_t *ents, int n);
+int sort_write_batch(struct batch_ent *ents, int n);
 int shim_lookup(pkey_t key, pval_t *val);
+int shim_lookup_version(pkey_t key, pval_t *val, struct key_version *ver);
 int shim_scan(pkey_t start, int range, pval_t *values);
 int shim_sync(log_state_t *lst, pnoid_t start, pnoid_t end, void *rec);
 pnoid_t shim_pnode_of(pkey_t key);
@@ -74,6 +117,8 @@ void index_layer_init(char* index_name, struct index_layer* layer, init_func_t i
                       insert_func_t insert, update_func_t update, remove_func_t remove,
 				      lookup_func_t lookup, scan_func_t scan, destory_func_t destroy);
 void index_layer_deinit(struct index_layer* layer);
+void index_layer_set_gc(struct index_layer* layer, gc_prepare_func_t prepare, gc_func_t gc);
+void index_layer_gc(struct index_layer* layer);
 
 #ifdef __cplusplus
 }
@@ -35,6 +35,22 @@ typedef struct {
 
 typedef uint32_t logid_t;
 
+struct lcb_stat {
+    unsigned long nr_wb;        /* write backs of a full LCB */
+    unsigned long nr_forced_wb; /* write backs asked by checkpoints */
+    unsigned long nr_sync_wb;   /* write backs asked by the owner */
+    unsigned long nr_contended; /* DIMM lock busy when full */
+    unsigned long nr_grow, nr_shrink;
+};
+
+struct admit_stat {
+    unsigned long nr_forced_chkpt;  /* checkpoints forced at the low watermark */
+    unsigned long nr_throttled;     /* writes slowed down above the high watermark */
+    unsigned long nr_blocked;       /* writes blocked at the hard limit */
+    unsigned long nr_rejected;      /* writes refused with -EAGAIN or -E2BIG */
+    unsigned long throttle_us;
+};
+
 struct log_layer {
 	unsigned int nflush; /* how many flushes */
 	atomic_t exit; /* thread exit */
@@ -43,6 +59,16 @@ struct log_layer {
     atomic_t epoch_passed;
 	atomic_t checkpoint;
 
+    /* Recovery of the logs of the last run. */
+    enum {
+        RECOVERY_NONE = 0,
+        RECOVERY_FETCH,     /* waiting to be fetched */
+        RECOVERY_SERVE      /* fetched, reads go through @recovery_logs */
+    } recovery;
+    struct oplog *recovery_logs; /* sorted, the latest one per key */
+    int nr_recovery_log;
+    atomic_t recovery_readers;
+
     struct {
         atomic_t cnt;
         char padding[CACHELINE_SIZE];
@@ -62,8 +88,20 @@ struct oplog {
 	__le64   o_type;  /* OP_INSERT or OP_REMOVE */
 } __packed;
 
+/* A fetched log, sorted and clustered in place of the log itself */
+struct oplog_ref {
+    uint64_t kprefix;   /* the first 8 bytes of the key, in key order */
+    __le64 stamp;
+    struct oplog *log;
+};
+
 struct cpu_log_region_meta {
+#ifndef OPLOG_COMPRESSION
     __le32 start, end;
+#else
+    /* (byte offset of the block << 32) | log nr, see @oplog_cblk */
+    __le64 start, end;
+#endif
 } __packed ____cacheline_aligned2;
 
 struct cpu_log_region {
@@ -83,15 +121,43 @@ struct cpu_log_region_desc {
     struct oplog *lcb;
     size_t lcb_size;
 
+    /* Adaptive LCB size, see @lcb_adapt */
+    size_t lcb_full_nr, lcb_max_nr;
+    unsigned lcb_fills; /* full write backs since the last checkpoint */
+    int lcb_contended;
+    struct lcb_stat lcb_stat;
+
+    /* Admission control of the region, see @oplog_admit */
+    int throttling;
+    struct admit_stat admit_stat;
+
     seqcount_t seq;
 
+    /*
+     * ENABLE: the owner is out of @oplog_insert, the master may steal
+     * DELAY: the owner is appending logs
+     * REQUEST: the master asks the owner to write back when it's done
+     * STEAL: the master is writing back for the owner
+     */
     enum {
         WBS_ENABLE,
         WBS_DELAY,
-        WBS_REQUEST
+        WBS_REQUEST,
+        WBS_STEAL
     } wb_state;
-    void *wb_new_buf;
-    int wb_done;
+    int wb_done; /* futex */
+    struct oplog *stale_lcb; /* written back by the master, freed next checkpoint */
+
+    /* Logs appended, and written back, in this run, see @oplog_sync */
+    uint64_t lsn, durable_lsn;
+
+#ifdef OPLOG_COMPRESSION
+    /* The region holds compressed blocks. Logs are read from the DRAM mirror. */
+    struct oplog *mirror;
+    uint32_t *cblk; /* byte offset of the block of each log */
+    uint32_t bstart, bend; /* bytes from @bstart to @bend are taken, see @oplog_admit */
+    uint32_t reclaim_from, reclaim_to; /* consumed by the last checkpoint */
+#endif
 } ____cacheline_aligned2;
 
 struct log_region_desc {
@@ -100,6 +166,16 @@ struct log_region_desc {
 
 struct oplog *oplog_get(logid_t logid);
 
+#ifndef STR_KEY
+/* A compact sort item of integer keys, see @sort_key_index */
+struct key_index {
+    uint64_t key;
+    uint64_t idx;
+};
+
+extern void sort_key_index(struct key_index *ki, int n);
+#endif
+
 struct pnode;
 struct mptable;
 struct log_layer;
@@ -107,14 +183,32 @@ struct log_layer;
 extern void oplog_snapshot_lst(log_state_t *lst);
 
 extern logid_t oplog_insert(log_state_t *lst, pkey_t key, pval_t val, optype_t op, txop_t txop, int cpu);
+extern void oplog_insert_batch(log_state_t *lst, const pentry_t *ents, const optype_t *ops, int n, optype_t op,
+                               txop_t txop, int cpu, logid_t *ids);
+
+extern void oplog_reserve(int cpu);
+extern logid_t oplog_insert_reserved(log_state_t *lst, pkey_t key, pval_t val, optype_t op, txop_t txop, int cpu);
+extern void oplog_reserve_done(int cpu);
+
+extern int oplog_admit(int cpu, int n, int can_wait);
+
+extern uint64_t oplog_lsn(int cpu);
+extern void oplog_sync(int cpu, uint64_t lsn);
+
+extern void oplog_lcb_stat(int cpu, struct lcb_stat *stat, size_t *lcb_full_nr);
+extern int oplog_admit_stat(int cpu, struct admit_stat *stat);
+extern void oplog_dump_stat();
 
 extern void oplog_flush();
+extern void oplog_recover();
+extern int oplog_recovery_lookup(pkey_t key, pval_t *val);
+extern void oplog_wait_recovery();
 
 extern void list_sort(void *priv, struct list_head *head,
 		int (*cmp)(void *priv, struct list_head *a,
 			struct list_head *b));
 
-int log_layer_init(struct log_layer* layer);
+int log_layer_init(struct log_layer* layer, int format);
 void log_layer_deinit(struct log_layer* layer);
 
 #ifdef __cplusplus
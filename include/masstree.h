@@ -45,8 +45,8 @@ typedef struct {
 extern masstree_t *	masstree_create(const masstree_ops_t *);
 extern void			masstree_destroy(masstree_t *);
 
-extern void *		masstree_gc_prepare(masstree_t *);
-extern void			masstree_gc(masstree_t *, void *);
+extern void *		masstree_gc_prepare(masstree_t *, size_t *);
+extern size_t		masstree_gc(masstree_t *, void *);
 extern size_t		masstree_maxheight(void);
 
 extern void *		masstree_get(masstree_t *, const void *, size_t, const void *);
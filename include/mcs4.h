@@ -1,6 +1,8 @@
 #ifndef MCS4_H
 #define MCS4_H
 
+#define NULL_QNODE          (-1)
+
 typedef struct {
     union {
         struct {
@@ -16,4 +18,8 @@ void mcs4_init(mcs4_t *lock);
 void mcs4_lock(mcs4_t *lock);
 void mcs4_unlock(mcs4_t *lock);
 
+static inline int mcs4_is_locked(mcs4_t *lock) {
+    return *(volatile uint32_t *) &lock->val != (uint32_t) NULL_QNODE;
+}
+
 #endif //MCS4_H
@@ -0,0 +1,95 @@
+#ifndef __QOS_H
+#define __QOS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <time.h>
+
+#include "config.h"
+#include "common.h"
+#include "arch.h"
+
+/* Time one in this many foreground ops. */
+#define QOS_SAMPLE_RATE         64
+
+/* Latency histogram: QOS_NR_BUCKET buckets of QOS_BUCKET_NS, the last one takes the rest. */
+#define QOS_BUCKET_NS           128
+#define QOS_NR_BUCKET           256
+
+#define QOS_PERCENTILE          99
+
+/* The controller looks at the latency this often during a checkpoint. */
+#define QOS_INTERVAL            1000000 /* ns */
+#define QOS_MIN_SAMPLES         32
+
+#define QOS_MIN_WORKER          1
+#define QOS_PACE_STEP           5       /* us */
+#define QOS_MAX_PACE            1000    /* us */
+#define QOS_PARK_TIME           100     /* us */
+
+struct qos_stat {
+    unsigned long nr_tick;
+    unsigned long nr_slowdown, nr_speedup;
+    unsigned long last_pct;     /* ns, of the last tick */
+    unsigned long target;       /* ns */
+    int nr_active, pace;
+    int min_active, max_pace;
+};
+
+static inline long qos_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef FLUSH_QOS
+
+extern __thread unsigned qos_nr_op;
+
+extern void qos_record(long ns);
+
+/* Return the start time if this op is sampled, 0 otherwise. */
+static inline long qos_sample_begin() {
+    if (likely(++qos_nr_op % QOS_SAMPLE_RATE)) {
+        return 0;
+    }
+    return qos_now();
+}
+
+static inline void qos_sample_end(long start) {
+    if (unlikely(start)) {
+        qos_record(qos_now() - start);
+    }
+}
+
+extern void qos_set_target(unsigned long ns);
+
+extern void qos_chkpt_begin();
+extern void qos_tick();
+extern int qos_worker_active(int wid);
+extern void qos_pace();
+
+extern void qos_stat(struct qos_stat *stat);
+extern void qos_dump_stat();
+
+#else
+
+static inline long qos_sample_begin() { return 0; }
+static inline void qos_sample_end(long start) { }
+
+static inline void qos_chkpt_begin() { }
+static inline void qos_tick() { }
+static inline int qos_worker_active(int wid) { return 1; }
+static inline void qos_pace() { }
+
+static inline void qos_dump_stat() { }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -26,7 +26,7 @@ struct data_layer;
 struct bonsai_desc;
 struct log_region;
 
-extern int log_region_init(struct log_layer* layer);
+extern int log_region_init(struct log_layer* layer, int format);
 extern void log_region_deinit(struct log_layer* layer);
 
 extern int data_region_init(struct data_layer *layer);
@@ -38,6 +38,11 @@ static inline void spin_lock(spinlock_t *lock) {
     :: "memory", "cc");
 }
 
+static inline int spin_is_locked(spinlock_t *lock) {
+    unsigned int slock = ACCESS_ONCE(lock->slock);
+    return (slock & 0xff) != ((slock >> 8) & 0xff);
+}
+
 static inline void spin_unlock(spinlock_t *lock) {
     __asm__ __volatile__("lock; incb %0;" : "+m" (lock->slock) :: "memory", "cc");
 }
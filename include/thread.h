@@ -7,27 +7,40 @@ extern "C" {
 
 #include <pthread.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 
 #include "config.h"
 #include "list.h"
 #include "common.h"
+#include "arch.h"
+#include "atomic.h"
+#include "kfifo.h"
 
 #define NUM_PFLUSH_WORKER           (NUM_PFLUSH_WORKER_PER_NODE * NUM_SOCKET)
 #define NUM_PFLUSH_THREAD           (NUM_PFLUSH_WORKER + 1)
 
-#define NUM_SMO_THREAD				1
+#define NUM_SMO_THREAD				4
 
 #define CHKPT_TIME_INTERVAL		700000
 #define CHKPT_NLOG_INTERVAL		10000
 
+/*
+ * How long a pflush thread spins before it sleeps on a futex. Only spin if
+ * every pflush thread has a CPU of its own, see @pflush_spin.
+ */
+#define PFLUSH_SPIN				(1 << 12)
+
+/* Pending works per pflush worker, a power of 2 */
+#define WORKQUEUE_SIZE			4
+
 struct log_layer;
 struct oplog_blk;
 
 enum {
-	WORKER_SLEEP = 0,
-	WORKER_RUNNING = NUM_PFLUSH_THREAD - 1,
 	ALL_WAKEUP = NUM_PFLUSH_THREAD,
 	MASTER_SLEEP = 100,
 	MASTER_WORK,
@@ -49,12 +62,13 @@ typedef void (*clean_func_t)(void*);
 struct work_struct {
 	work_func_t exec;
 	void* exec_arg;
-	struct list_head list;
 };
 
+/* Single producer (the master), single consumer (the worker) */
 struct workqueue_struct {
 	struct thread_info* thread;
-	struct list_head head;
+	DECLARE_KFIFO(works, struct work_struct, WORKQUEUE_SIZE);
+	int sleeping;	/* futex, the worker waits on it for works */
 };
 
 struct thread_info {
@@ -69,16 +83,63 @@ struct thread_info {
 
 extern __thread struct thread_info* __this;
 
-static inline void workqueue_add(struct workqueue_struct* wq, struct work_struct* work) {
-	list_add(&work->list, &wq->head);
+extern int pflush_spin;
+
+#define gettid() ((pid_t)syscall(SYS_gettid))
+
+static inline void futex_wait(int *uaddr, int val) {
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
 }
 
-static inline void workqueue_del(struct work_struct* work) {
-	list_del(&work->list);
-	free(work);
+static inline void futex_wake(int *uaddr) {
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 }
 
-#define gettid() ((pid_t)syscall(SYS_gettid))
+/*
+ * Sense-reversing barrier for the pflush workers. The last one to arrive
+ * flips the sense. The others spin on it for a while, then sleep on it.
+ */
+typedef struct {
+	atomic_t count;
+	atomic_t sleepers;
+	int sense;
+	int nr;
+} worker_barrier_t;
+
+static inline void worker_barrier_init(worker_barrier_t *b, int nr) {
+	atomic_set(&b->count, nr);
+	atomic_set(&b->sleepers, 0);
+	b->sense = 0;
+	b->nr = nr;
+}
+
+static inline void worker_barrier_wait(worker_barrier_t *b) {
+	int sense = ACCESS_ONCE(b->sense), spin;
+
+	if (atomic_sub_return(1, &b->count) == 0) {
+		atomic_set(&b->count, b->nr);
+		ACCESS_ONCE(b->sense) = !sense;
+		smp_mb();
+		if (atomic_read(&b->sleepers)) {
+			futex_wake(&b->sense);
+		}
+		return;
+	}
+
+	for (spin = 0; spin < pflush_spin; spin++) {
+		if (ACCESS_ONCE(b->sense) != sense) {
+			return;
+		}
+		cpu_relax();
+	}
+
+	atomic_inc(&b->sleepers);
+	smp_mb();
+	while (ACCESS_ONCE(b->sense) == sense) {
+		futex_wait(&b->sense, sense);
+	}
+	atomic_dec(&b->sleepers);
+}
 
 extern void bonsai_self_thread_init();
 extern void bonsai_self_thread_exit();
@@ -91,10 +152,14 @@ extern void bonsai_user_thread_exit();
 
 extern void wakeup_master();
 extern void park_master();
-extern void park_workers();
-extern void wakeup_workers();
+extern int park_master_timeout(long usec);
+
+extern void queue_work(struct thread_info *thread, work_func_t exec, void *arg);
+extern void wait_works();
 
-extern void wakeup_smo();
+extern void wakeup_smo(int part);
+extern void do_smo(int part);
+extern int smo_pending(int part);
 
 extern int bonsai_smo_thread_init();
 extern int bonsai_smo_thread_exit();
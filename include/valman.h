@@ -24,7 +24,7 @@ void valman_pull(pval_t val);
 
 size_t valman_vpool_dimm_size();
 
-void valman_vpool_init();
+void valman_vpool_init(int format);
 
 int valman_pval_is_remote(pval_t pval);
 
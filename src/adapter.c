@@ -10,6 +10,7 @@
 
 #include "bonsai.h"
 #include "masstree.h"
+#include "art.h"
 #include "counter.h"
 
 #define INT2KEY(val)        (* (pkey_t *) (unsigned long []) { (val) })
@@ -18,20 +19,22 @@ struct bonsai_config {
     int nr_user_cpus;
     int *user_cpus;
     int stm_support;
+    /* The DRAM index: "masstree" (also if NULL) or "art" */
+    const char *index;
 };
 
-static void *masstree_alloc(size_t size) {
+static void *index_mem_alloc(size_t size) {
     COUNTER_ADD(index_mem, size);
     return malloc(size);
 }
 
-static void masstree_free(void *p, size_t size) {
+static void index_mem_free(void *p, size_t size) {
     COUNTER_SUB(index_mem, size);
     free(p);
 }
 
 static void *index_init() {
-    static masstree_ops_t ops = { .alloc = masstree_alloc, .free = masstree_free };
+    static masstree_ops_t ops = { .alloc = index_mem_alloc, .free = index_mem_free };
     return (void*) masstree_create(&ops);
 }
 
@@ -73,10 +76,48 @@ static int index_scan(void* index_struct, const void *min, const void *max) {
     return 0;
 }
 
+static void* index_gc_prepare(void* index_struct, size_t *bytes) {
+    return masstree_gc_prepare((masstree_t*) index_struct, bytes);
+}
+
+static size_t index_gc(void* index_struct, void *gc) {
+    return masstree_gc((masstree_t*) index_struct, gc);
+}
+
+static void *art_index_init() {
+    static art_ops_t ops = { .alloc = index_mem_alloc, .free = index_mem_free };
+    return (void*) art_create(&ops);
+}
+
+static void art_index_destory(void* index_struct) {
+    art_destroy((art_t*) index_struct);
+}
+
+static void* art_index_gc_prepare(void* index_struct, size_t *bytes) {
+    return art_gc_prepare((art_t*) index_struct, bytes);
+}
+
+static size_t art_index_gc(void* index_struct, void *gc) {
+    return art_gc((art_t*) index_struct, gc);
+}
+
+static int art_index_insert(void* index_struct, const void *key, size_t len, const void *value) {
+    return art_put((art_t*) index_struct, key, len, (void*) value);
+}
+
+static int art_index_remove(void* index_struct, const void *key, size_t len) {
+    return art_del((art_t*) index_struct, key, len);
+}
+
+static void* art_index_lowerbound(void* index_struct, const void *key, size_t len, const void *actual_key) {
+    return art_get((art_t*) index_struct, key, len, (void*) actual_key);
+}
+
 extern int
 bonsai_init(char *index_name, init_func_t init, destory_func_t destory, insert_func_t insert, update_func_t update,
             remove_func_t remove, lookup_func_t lookup, scan_func_t scan);
 extern void bonsai_deinit();
+extern void bonsai_set_index_gc(gc_prepare_func_t prepare, gc_func_t gc);
 
 extern void bonsai_mark_cpu(int cpu);
 extern void bonsai_barrier();
@@ -89,18 +130,45 @@ extern pkey_t bonsai_make_key(const void *key, size_t len);
 extern int bonsai_insert(pkey_t key, pval_t value);
 extern int bonsai_remove(pkey_t key);
 extern int bonsai_insert_commit(pkey_t key, pval_t value);
+extern int bonsai_insert_batch(pkey_t *keys, pval_t *values, int n);
 extern int bonsai_remove_commit(pkey_t key);
+extern int bonsai_insert_sync(pkey_t key, pval_t value);
+extern int bonsai_remove_sync(pkey_t key);
+extern uint64_t bonsai_last_seq();
+extern void bonsai_wait_durable(uint64_t seq);
+extern void bonsai_sync();
 extern int bonsai_lookup(pkey_t key, pval_t *val);
 extern int bonsai_scan(pkey_t start, int range, pval_t *values);
 
 extern void bonsai_dtx_start();
 extern void bonsai_dtx_commit();
 
+struct bonsai_write_batch;
+
+extern struct bonsai_write_batch *bonsai_write_batch_create();
+extern void bonsai_write_batch_destroy(struct bonsai_write_batch *batch);
+extern void bonsai_write_batch_clear(struct bonsai_write_batch *batch);
+extern void bonsai_write_batch_put(struct bonsai_write_batch *batch, pkey_t key, pval_t value);
+extern void bonsai_write_batch_delete(struct bonsai_write_batch *batch, pkey_t key);
+extern int bonsai_write_batch(struct bonsai_write_batch *batch);
+
+extern void bonsai_txn_begin();
+extern int bonsai_txn_lookup(pkey_t key, pval_t *val);
+extern int bonsai_txn_insert(pkey_t key, pval_t value);
+extern int bonsai_txn_remove(pkey_t key);
+extern int bonsai_txn_insert_sync(pkey_t key, pval_t value);
+extern int bonsai_txn_remove_sync(pkey_t key);
+extern int bonsai_txn_commit();
+extern void bonsai_txn_rollback();
+
 extern int bonsai_user_thread_init();
 extern void bonsai_user_thread_exit();
 
 size_t bonsai_get_dram_usage();
 
+/* The write batch of this thread, see @kv_write_batch */
+static __thread struct bonsai_write_batch *wbatch;
+
 const char *kv_engine() {
     return "bonsai";
 }
@@ -111,8 +179,15 @@ void *kv_create_context(void *config) {
     for (i = 0; i < bonsai_config->nr_user_cpus; i++) {
         bonsai_mark_cpu(bonsai_config->user_cpus[i]);
     }
-    bonsai_init("masstree",
-                index_init, index_destory, index_insert, index_update, index_remove, index_lowerbound, index_scan);
+    if (bonsai_config->index && !strcmp(bonsai_config->index, "art")) {
+        bonsai_init("art", art_index_init, art_index_destory, art_index_insert, art_index_insert,
+                    art_index_remove, art_index_lowerbound, index_scan);
+        bonsai_set_index_gc(art_index_gc_prepare, art_index_gc);
+    } else {
+        bonsai_init("masstree",
+                    index_init, index_destory, index_insert, index_update, index_remove, index_lowerbound, index_scan);
+        bonsai_set_index_gc(index_gc_prepare, index_gc);
+    }
     return NULL;
 }
 
@@ -129,6 +204,7 @@ void kv_stop_test(void *context) {
 
     printf("===== Counters =====\n");
     printf("index memory: %lu bytes\n", COUNTER_GET(index_mem));
+    printf("index retired: %lu bytes, freed: %lu bytes\n", COUNTER_GET(index_retired), COUNTER_GET(index_freed));
     printf("nr_ino: %d\n", COUNTER_GET(nr_ino));
     printf("nr_pno: %d\n", COUNTER_GET(nr_pno));
     printf("====================\n");
@@ -144,6 +220,10 @@ void *kv_thread_create_context(void *context, int id) {
 
 void kv_thread_destroy_context(void *tcontext) {
     assert(tcontext == NULL);
+    if (wbatch) {
+        bonsai_write_batch_destroy(wbatch);
+        wbatch = NULL;
+    }
     bonsai_user_thread_exit();
 }
 
@@ -157,16 +237,30 @@ void kv_thread_stop_test(void *tcontext) {
     bonsai_offline();
 }
 
+/* Inside kv_txn_begin/kv_txn_commit, the ops go through the transaction. */
+static __thread int in_txn;
+
 void kv_txn_begin(void *tcontext) {
-    assert(0);
+    assert(tcontext == NULL);
+    bonsai_txn_begin();
+    in_txn = 1;
 }
 
 void kv_txn_rollback(void *tcontext) {
-    assert(0);
+    assert(tcontext == NULL);
+    bonsai_txn_rollback();
+    in_txn = 0;
 }
 
-void kv_txn_commit(void *tcontext) {
-    assert(0);
+/*
+ * Return 0 if committed, or -EAGAIN if it conflicted and was rolled back.
+ * -E2BIG: rolled back, too many writes to ever commit. Durable on return
+ * if a write was made by kv_put_sync or kv_del_sync.
+ */
+int kv_txn_commit(void *tcontext) {
+    assert(tcontext == NULL);
+    in_txn = 0;
+    return bonsai_txn_commit();
 }
 
 static inline pkey_t get_pkey(void *key, size_t key_len) {
@@ -179,9 +273,13 @@ static inline pkey_t get_pkey(void *key, size_t key_len) {
 #endif
 }
 
+/*
+ * Stage a value for bonsai, which copies it to NVM. Release it with
+ * release_pval once the call returns, whether it got in or not.
+ */
 static inline pval_t get_pval(void *val, size_t val_len) {
 #ifdef STR_VAL
-    uint8_t val_[VAL_LEN] = { 0 };
+    uint8_t *val_ = calloc(1, VAL_LEN);
     assert(val_len <= VAL_LEN);
     memcpy(val_, val, val_len);
     return bonsai_make_val(VCLASS, val_);
@@ -191,24 +289,159 @@ static inline pval_t get_pval(void *val, size_t val_len) {
 #endif
 }
 
+static inline void release_pval(pval_t pval) {
+#ifdef STR_VAL
+    bonsai_free_val(pval);
+#endif
+}
+
 int kv_put(void *tcontext, void *key, size_t key_len, void *val, size_t val_len) {
     pkey_t pkey = get_pkey(key, key_len);
+    pval_t pval = get_pval(val, val_len);
+    int ret;
     assert(tcontext == NULL);
-    return bonsai_insert_commit(pkey, get_pval(val, val_len));
+    if (in_txn) {
+        ret = bonsai_txn_insert(pkey, pval);
+    } else {
+        ret = bonsai_insert_commit(pkey, pval);
+    }
+    release_pval(pval);
+    return ret;
+}
+
+/* kv_put, durable on return. In a transaction, kv_txn_commit is. */
+int kv_put_sync(void *tcontext, void *key, size_t key_len, void *val, size_t val_len) {
+    pkey_t pkey = get_pkey(key, key_len);
+    pval_t pval = get_pval(val, val_len);
+    int ret;
+    assert(tcontext == NULL);
+    if (in_txn) {
+        ret = bonsai_txn_insert_sync(pkey, pval);
+    } else {
+        ret = bonsai_insert_sync(pkey, pval);
+    }
+    release_pval(pval);
+    return ret;
+}
+
+int kv_put_batch(void *tcontext, int n, void **keys, size_t *key_lens, void **vals, size_t *val_lens) {
+    pkey_t *pkeys = malloc(n * sizeof(*pkeys));
+    pval_t *pvals = malloc(n * sizeof(*pvals));
+    int i, ret;
+    assert(tcontext == NULL);
+    for (i = 0; i < n; i++) {
+        pkeys[i] = get_pkey(keys[i], key_lens[i]);
+        pvals[i] = get_pval(vals[i], val_lens[i]);
+    }
+    if (in_txn) {
+        for (i = 0, ret = 0; i < n && !ret; i++) {
+            ret = bonsai_txn_insert(pkeys[i], pvals[i]);
+        }
+    } else {
+        ret = bonsai_insert_batch(pkeys, pvals, n);
+    }
+    for (i = 0; i < n; i++) {
+        release_pval(pvals[i]);
+    }
+    free(pkeys);
+    free(pvals);
+    return ret;
+}
+
+/*
+ * Apply @n puts and deletes atomically: a put if @vals[i] is set, a delete
+ * otherwise. Return -EAGAIN, with nothing applied, if the log region can't
+ * take them now, or -E2BIG if it never can.
+ */
+int kv_write_batch(void *tcontext, int n, void **keys, size_t *key_lens, void **vals, size_t *val_lens) {
+    pval_t pval, *pvals;
+    pkey_t pkey;
+    int i, ret;
+    assert(tcontext == NULL);
+    if (in_txn) {
+        for (i = 0, ret = 0; i < n && !ret; i++) {
+            pkey = get_pkey(keys[i], key_lens[i]);
+            if (vals[i]) {
+                pval = get_pval(vals[i], val_lens[i]);
+                ret = bonsai_txn_insert(pkey, pval);
+                release_pval(pval);
+            } else {
+                ret = bonsai_txn_remove(pkey);
+            }
+        }
+        return ret;
+    }
+    if (unlikely(!wbatch)) {
+        wbatch = bonsai_write_batch_create();
+    }
+    pvals = malloc(n * sizeof(*pvals));
+    for (i = 0; i < n; i++) {
+        pkey = get_pkey(keys[i], key_lens[i]);
+        if (vals[i]) {
+            pvals[i] = get_pval(vals[i], val_lens[i]);
+            bonsai_write_batch_put(wbatch, pkey, pvals[i]);
+        } else {
+            bonsai_write_batch_delete(wbatch, pkey);
+        }
+    }
+    ret = bonsai_write_batch(wbatch);
+    bonsai_write_batch_clear(wbatch);
+    /* Copied to NVM if written, and dropped with the batch otherwise. */
+    for (i = 0; i < n; i++) {
+        if (vals[i]) {
+            release_pval(pvals[i]);
+        }
+    }
+    free(pvals);
+    return ret;
 }
 
 int kv_del(void *tcontext, void *key, size_t key_len) {
     pkey_t pkey = get_pkey(key, key_len);
     assert(tcontext == NULL);
+    if (in_txn) {
+        return bonsai_txn_remove(pkey);
+    }
     return bonsai_remove_commit(pkey);
 }
 
+int kv_del_sync(void *tcontext, void *key, size_t key_len) {
+    pkey_t pkey = get_pkey(key, key_len);
+    assert(tcontext == NULL);
+    if (in_txn) {
+        return bonsai_txn_remove_sync(pkey);
+    }
+    return bonsai_remove_sync(pkey);
+}
+
+/* The sequence number of the last write of this thread, for kv_wait_durable. */
+uint64_t kv_last_seq(void *tcontext) {
+    assert(tcontext == NULL);
+    return bonsai_last_seq();
+}
+
+/* Wait till the writes of this thread up to @seq are durable. */
+void kv_wait_durable(void *tcontext, uint64_t seq) {
+    assert(tcontext == NULL);
+    bonsai_wait_durable(seq);
+}
+
+/* Make every write of this thread so far durable. */
+void kv_sync(void *tcontext) {
+    assert(tcontext == NULL);
+    bonsai_sync();
+}
+
 int kv_get(void *tcontext, void *key, size_t key_len, void *val, size_t *val_len) {
     pkey_t pkey = get_pkey(key, key_len);
     pval_t pval;
     int ret;
     assert(tcontext == NULL);
-    ret = bonsai_lookup(pkey, &pval);
+    if (in_txn) {
+        ret = bonsai_txn_lookup(pkey, &pval);
+    } else {
+        ret = bonsai_lookup(pkey, &pval);
+    }
     if (likely(!ret)) {
 #ifdef STR_VAL
         void *ptr;
@@ -226,5 +459,7 @@ int kv_get(void *tcontext, void *key, size_t key_len, void *val, size_t *val_len
 void kv_scan(void *tcontext, void *key, size_t key_len, int range, void *values) {
     pkey_t pkey = get_pkey(key, key_len);
     assert(tcontext == NULL);
+    /* Scans are not validated. */
+    assert(!in_txn);
     bonsai_scan(pkey, range, values);
 }
@@ -0,0 +1,733 @@
+/*
+ * BonsaiKV: Towards Fast, Scalable, and Persistent Key-Value Stores with Tiered, Heterogeneous Memory System
+ *
+ * Adaptive Radix Tree: an alternative DRAM index with predecessor search
+ *
+ * The readers take no locks. They check the version of every node they go
+ * through, and restart from the root if it changed. The writers take the
+ * tree lock, as the index only changes on inode splits and merges. The
+ * prefix and the size of a node never change: the node is copied and
+ * swapped in instead, and the old one becomes obsolete. The garbage stays
+ * till art_gc_prepare takes it, and art_gc frees it once no reader can be
+ * on it any more.
+ */
+
+#define _GNU_SOURCE
+#include "cpu.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <immintrin.h>
+
+#include "arch.h"
+#include "atomic.h"
+#include "spinlock.h"
+#include "art.h"
+
+#define NODE4       0
+#define NODE16      1
+#define NODE48      2
+#define NODE256     3
+
+/* @version: set V_LOCKED while a writer changes the node, bump it after. */
+#define V_LOCKED    1ul
+#define V_OBSOLETE  2ul
+#define V_STEP      4ul
+
+struct art_node {
+    uint64_t version;
+    uint16_t nr;
+    uint8_t  type;
+    uint8_t  prefix_len;
+    uint8_t  prefix[ART_MAX_KEY_LEN];
+};
+
+/* Sorted by key */
+struct node4 {
+    struct art_node n;
+    uint8_t keys[4];
+    void *children[4];
+};
+
+struct node16 {
+    struct art_node n;
+    uint8_t keys[16];
+    void *children[16];
+};
+
+/* @index: the slot in @children + 1, or 0 if none */
+struct node48 {
+    struct art_node n;
+    uint8_t index[256];
+    void *children[48];
+};
+
+struct node256 {
+    struct art_node n;
+    void *children[256];
+};
+
+/* A child is either a node, or a leaf tagged with bit 0. */
+struct art_leaf {
+    void *val;
+    uint8_t len;
+    uint8_t key[];
+};
+
+struct art {
+    /* A node256, never replaced */
+    struct art_node *root;
+    const art_ops_t *ops;
+    spinlock_t lock;
+
+    /* Obsolete nodes and removed leaves */
+    void **gc;
+    size_t nr_gc, gc_cap;
+};
+
+/* A batch of garbage taken by art_gc_prepare */
+struct art_gc {
+    void **ents;
+    size_t nr;
+};
+
+static const size_t node_size[] = {
+    [NODE4]     = sizeof(struct node4),
+    [NODE16]    = sizeof(struct node16),
+    [NODE48]    = sizeof(struct node48),
+    [NODE256]   = sizeof(struct node256),
+};
+
+static const unsigned node_cap[] = {
+    [NODE4]     = 4,
+    [NODE16]    = 16,
+    [NODE48]    = 48,
+    [NODE256]   = 256,
+};
+
+static inline int is_leaf(const void *p) {
+    return (unsigned long) p & 1;
+}
+
+static inline struct art_leaf *to_leaf(const void *p) {
+    return (struct art_leaf *) ((unsigned long) p & ~1ul);
+}
+
+static inline void *leaf_ptr(struct art_leaf *leaf) {
+    return (void *) ((unsigned long) leaf | 1);
+}
+
+/* The sorted arrays of a node4 or node16 */
+static inline unsigned sorted_arrays(struct art_node *node, uint8_t **keys, void ***children) {
+    if (node->type == NODE4) {
+        *keys = ((struct node4 *) node)->keys;
+        *children = ((struct node4 *) node)->children;
+    } else {
+        *keys = ((struct node16 *) node)->keys;
+        *children = ((struct node16 *) node)->children;
+    }
+    return min((unsigned) ACCESS_ONCE(node->nr), node_cap[node->type]);
+}
+
+static void **find_slot(struct art_node *node, uint8_t c) {
+    struct node48 *n48 = (struct node48 *) node;
+    struct node256 *n256 = (struct node256 *) node;
+    unsigned nr, i, mask;
+    void **children;
+    uint8_t *keys;
+    __m128i cmp;
+
+    switch (node->type) {
+    case NODE4:
+        nr = sorted_arrays(node, &keys, &children);
+        for (i = 0; i < nr; i++) {
+            if (keys[i] == c) {
+                return &children[i];
+            }
+        }
+        return NULL;
+
+    case NODE16:
+        nr = sorted_arrays(node, &keys, &children);
+        cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char) c), _mm_loadu_si128((const __m128i *) keys));
+        mask = _mm_movemask_epi8(cmp) & ((1u << nr) - 1);
+        return mask ? &children[__builtin_ctz(mask)] : NULL;
+
+    case NODE48:
+        i = ACCESS_ONCE(n48->index[c]);
+        return i ? &n48->children[i - 1] : NULL;
+
+    default:
+        return ACCESS_ONCE(n256->children[c]) ? &n256->children[c] : NULL;
+    }
+}
+
+/* The child with the largest key below @c (at most 256), or NULL */
+static void *prev_child(struct art_node *node, unsigned c) {
+    struct node48 *n48 = (struct node48 *) node;
+    struct node256 *n256 = (struct node256 *) node;
+    void **children, *child;
+    unsigned nr, i, slot;
+    uint8_t *keys;
+
+    switch (node->type) {
+    case NODE4:
+    case NODE16:
+        nr = sorted_arrays(node, &keys, &children);
+        for (i = nr; i-- > 0; ) {
+            if (keys[i] < c) {
+                return ACCESS_ONCE(children[i]);
+            }
+        }
+        return NULL;
+
+    case NODE48:
+        for (i = c; i-- > 0; ) {
+            slot = ACCESS_ONCE(n48->index[i]);
+            if (slot) {
+                return ACCESS_ONCE(n48->children[slot - 1]);
+            }
+        }
+        return NULL;
+
+    default:
+        for (i = c; i-- > 0; ) {
+            child = ACCESS_ONCE(n256->children[i]);
+            if (child) {
+                return child;
+            }
+        }
+        return NULL;
+    }
+}
+
+static inline int read_begin(struct art_node *node, uint64_t *v) {
+    uint64_t ver;
+
+    while ((ver = ACCESS_ONCE(node->version)) & V_LOCKED) {
+        cpu_relax();
+    }
+    if (unlikely(ver & V_OBSOLETE)) {
+        return 0;
+    }
+
+    *v = ver;
+    smp_rmb();
+    return 1;
+}
+
+static inline int read_validate(struct art_node *node, uint64_t v) {
+    smp_rmb();
+    return ACCESS_ONCE(node->version) == v;
+}
+
+/*
+ * The largest leaf under @p. Return 0, -ENOENT if there's no leaf (an empty
+ * root), or -EAGAIN to restart.
+ */
+static int max_leaf(void *p, struct art_leaf **leaf) {
+    struct art_node *node;
+    void *child;
+    uint64_t v;
+
+    while (!is_leaf(p)) {
+        node = p;
+        if (!read_begin(node, &v)) {
+            return -EAGAIN;
+        }
+        child = prev_child(node, 256);
+        if (!read_validate(node, v)) {
+            return -EAGAIN;
+        }
+        if (!child) {
+            return -ENOENT;
+        }
+        p = child;
+    }
+
+    *leaf = to_leaf(p);
+    return 0;
+}
+
+/*
+ * The largest leaf <= @key under @p, which is at @depth of @key. Return 0,
+ * -ENOENT if all the keys under @p are larger, or -EAGAIN to restart.
+ */
+static int lower_bound(void *p, const uint8_t *key, size_t len, unsigned depth, struct art_leaf **leaf) {
+    struct art_node *node;
+    void **slot, *child;
+    unsigned plen;
+    uint64_t v;
+    int cmp, ret;
+
+    if (is_leaf(p)) {
+        if (memcmp(to_leaf(p)->key, key, len) > 0) {
+            return -ENOENT;
+        }
+        *leaf = to_leaf(p);
+        return 0;
+    }
+
+    node = p;
+    if (!read_begin(node, &v)) {
+        return -EAGAIN;
+    }
+
+    /* The prefix of a node never changes. */
+    plen = node->prefix_len;
+    assert(depth + plen < len);
+    cmp = memcmp(node->prefix, key + depth, plen);
+    if (cmp > 0) {
+        return -ENOENT;
+    }
+    if (cmp < 0) {
+        return max_leaf(node, leaf);
+    }
+    depth += plen;
+
+    slot = find_slot(node, key[depth]);
+    child = slot ? ACCESS_ONCE(*slot) : NULL;
+    if (!read_validate(node, v)) {
+        return -EAGAIN;
+    }
+
+    if (child) {
+        ret = lower_bound(child, key, len, depth + 1, leaf);
+        if (ret != -ENOENT) {
+            return ret;
+        }
+    }
+
+    child = prev_child(node, key[depth]);
+    if (!read_validate(node, v)) {
+        return -EAGAIN;
+    }
+
+    return child ? max_leaf(child, leaf) : -ENOENT;
+}
+
+void *art_get(art_t *tree, const void *key, size_t len, void *actual_key) {
+    struct art_leaf *leaf;
+    int ret;
+
+    do {
+        ret = lower_bound(tree->root, key, len, 0, &leaf);
+    } while (unlikely(ret == -EAGAIN));
+
+    if (unlikely(ret)) {
+        return NULL;
+    }
+
+    if (actual_key) {
+        memcpy(actual_key, leaf->key, len);
+    }
+    return ACCESS_ONCE(leaf->val);
+}
+
+static struct art_node *node_new(art_t *tree, int type, const uint8_t *prefix, unsigned plen) {
+    struct art_node *node = tree->ops->alloc(node_size[type]);
+
+    memset(node, 0, node_size[type]);
+    node->type = type;
+    node->prefix_len = plen;
+    if (plen) {
+        memcpy(node->prefix, prefix, plen);
+    }
+
+    return node;
+}
+
+static void *leaf_new(art_t *tree, const uint8_t *key, size_t len, void *val) {
+    struct art_leaf *leaf = tree->ops->alloc(sizeof(*leaf) + len);
+
+    leaf->val = val;
+    leaf->len = len;
+    memcpy(leaf->key, key, len);
+
+    return leaf_ptr(leaf);
+}
+
+static size_t one_size(void *p) {
+    return is_leaf(p) ? sizeof(struct art_leaf) + to_leaf(p)->len :
+                        node_size[((struct art_node *) p)->type];
+}
+
+static size_t free_one(art_t *tree, void *p) {
+    size_t size = one_size(p);
+
+    tree->ops->free(is_leaf(p) ? (void *) to_leaf(p) : p, size);
+    return size;
+}
+
+static void retire(art_t *tree, void *p) {
+    if (tree->nr_gc == tree->gc_cap) {
+        tree->gc_cap = tree->gc_cap ? tree->gc_cap * 2 : 64;
+        tree->gc = realloc(tree->gc, tree->gc_cap * sizeof(void *));
+    }
+    tree->gc[tree->nr_gc++] = p;
+}
+
+static inline void write_lock(struct art_node *node) {
+    ACCESS_ONCE(node->version) = node->version | V_LOCKED;
+    smp_wmb();
+}
+
+static inline void write_unlock(struct art_node *node) {
+    smp_wmb();
+    ACCESS_ONCE(node->version) = (node->version & ~V_LOCKED) + V_STEP;
+}
+
+static void make_obsolete(art_t *tree, struct art_node *node) {
+    smp_wmb();
+    ACCESS_ONCE(node->version) = (node->version + V_STEP) | V_OBSOLETE;
+    retire(tree, node);
+}
+
+/* Point the slot @ref of @owner to @p. */
+static void replace(struct art_node *owner, void **ref, void *p) {
+    write_lock(owner);
+    ACCESS_ONCE(*ref) = p;
+    write_unlock(owner);
+}
+
+/* Add a child, there must be room. */
+static void node_insert(struct art_node *node, uint8_t c, void *child) {
+    struct node48 *n48 = (struct node48 *) node;
+    struct node256 *n256 = (struct node256 *) node;
+    void **children;
+    uint8_t *keys;
+    unsigned i;
+
+    assert(node->nr < node_cap[node->type]);
+
+    switch (node->type) {
+    case NODE4:
+    case NODE16:
+        sorted_arrays(node, &keys, &children);
+        for (i = node->nr; i > 0 && keys[i - 1] > c; i--) {
+            keys[i] = keys[i - 1];
+            children[i] = children[i - 1];
+        }
+        keys[i] = c;
+        children[i] = child;
+        break;
+
+    case NODE48:
+        for (i = 0; n48->children[i]; i++)
+            ;
+        n48->children[i] = child;
+        n48->index[c] = i + 1;
+        break;
+
+    default:
+        n256->children[c] = child;
+    }
+
+    node->nr++;
+}
+
+static void node_remove(struct art_node *node, uint8_t c) {
+    struct node48 *n48 = (struct node48 *) node;
+    struct node256 *n256 = (struct node256 *) node;
+    void **children;
+    unsigned nr, i;
+    uint8_t *keys;
+
+    switch (node->type) {
+    case NODE4:
+    case NODE16:
+        nr = sorted_arrays(node, &keys, &children);
+        for (i = 0; keys[i] != c; i++)
+            ;
+        for (; i + 1 < nr; i++) {
+            keys[i] = keys[i + 1];
+            children[i] = children[i + 1];
+        }
+        break;
+
+    case NODE48:
+        i = n48->index[c];
+        n48->index[c] = 0;
+        n48->children[i - 1] = NULL;
+        break;
+
+    default:
+        n256->children[c] = NULL;
+    }
+
+    node->nr--;
+}
+
+/* Collect the children of @node in key order, return how many. */
+static unsigned node_entries(struct art_node *node, uint8_t *keys, void **children) {
+    struct node48 *n48 = (struct node48 *) node;
+    struct node256 *n256 = (struct node256 *) node;
+    unsigned nr = 0, c;
+    void **sorted;
+    uint8_t *skeys;
+
+    switch (node->type) {
+    case NODE4:
+    case NODE16:
+        nr = sorted_arrays(node, &skeys, &sorted);
+        memcpy(keys, skeys, nr);
+        memcpy(children, sorted, nr * sizeof(void *));
+        break;
+
+    case NODE48:
+        for (c = 0; c < 256; c++) {
+            if (n48->index[c]) {
+                keys[nr] = c;
+                children[nr++] = n48->children[n48->index[c] - 1];
+            }
+        }
+        break;
+
+    default:
+        for (c = 0; c < 256; c++) {
+            if (n256->children[c]) {
+                keys[nr] = c;
+                children[nr++] = n256->children[c];
+            }
+        }
+    }
+
+    return nr;
+}
+
+static void node_copy(struct art_node *dst, struct art_node *src) {
+    uint8_t keys[256];
+    void *children[256];
+    unsigned nr, i;
+
+    nr = node_entries(src, keys, children);
+    for (i = 0; i < nr; i++) {
+        node_insert(dst, keys[i], children[i]);
+    }
+}
+
+static unsigned prefix_mismatch(struct art_node *node, const uint8_t *key, unsigned depth) {
+    unsigned i;
+    for (i = 0; i < node->prefix_len; i++) {
+        if (node->prefix[i] != key[depth + i]) {
+            break;
+        }
+    }
+    return i;
+}
+
+int art_put(art_t *tree, const void *key_, size_t len, void *val) {
+    struct art_node *node, *owner = NULL, *n, *rest;
+    void **ref, **oref = NULL, *child;
+    const uint8_t *key = key_;
+    struct art_leaf *leaf;
+    unsigned depth = 0, p, i;
+
+    assert(len <= ART_MAX_KEY_LEN);
+
+    spin_lock(&tree->lock);
+
+    node = tree->root;
+    for (;;) {
+        p = prefix_mismatch(node, key, depth);
+        if (unlikely(p < node->prefix_len)) {
+            /* Split the prefix: a node4 with the common part, above a copy with the rest. */
+            n = node_new(tree, NODE4, node->prefix, p);
+            rest = node_new(tree, node->type, node->prefix + p + 1, node->prefix_len - p - 1);
+            node_copy(rest, node);
+            node_insert(n, node->prefix[p], rest);
+            node_insert(n, key[depth + p], leaf_new(tree, key, len, val));
+            replace(owner, oref, n);
+            make_obsolete(tree, node);
+            break;
+        }
+        depth += node->prefix_len;
+
+        ref = find_slot(node, key[depth]);
+        if (!ref) {
+            child = leaf_new(tree, key, len, val);
+            if (node->nr < node_cap[node->type]) {
+                write_lock(node);
+                node_insert(node, key[depth], child);
+                write_unlock(node);
+            } else {
+                /* Grow, the root never does. */
+                n = node_new(tree, node->type + 1, node->prefix, node->prefix_len);
+                node_copy(n, node);
+                node_insert(n, key[depth], child);
+                replace(owner, oref, n);
+                make_obsolete(tree, node);
+            }
+            break;
+        }
+
+        child = *ref;
+        if (is_leaf(child)) {
+            leaf = to_leaf(child);
+            if (!memcmp(leaf->key, key, len)) {
+                ACCESS_ONCE(leaf->val) = val;
+                break;
+            }
+            /* Both leaves go under a node4, after their common bytes. */
+            for (i = depth + 1; leaf->key[i] == key[i]; i++)
+                ;
+            n = node_new(tree, NODE4, key + depth + 1, i - depth - 1);
+            node_insert(n, leaf->key[i], child);
+            node_insert(n, key[i], leaf_new(tree, key, len, val));
+            replace(node, ref, n);
+            break;
+        }
+
+        owner = node;
+        oref = ref;
+        node = child;
+        depth++;
+    }
+
+    spin_unlock(&tree->lock);
+
+    return 0;
+}
+
+int art_del(art_t *tree, const void *key_, size_t len) {
+    struct art_node *path[ART_MAX_KEY_LEN], *node;
+    uint8_t bytes[ART_MAX_KEY_LEN];
+    const uint8_t *key = key_;
+    int top = 0, d, ret = -ENOENT;
+    unsigned depth = 0;
+    void **ref, *child;
+
+    assert(len <= ART_MAX_KEY_LEN);
+
+    spin_lock(&tree->lock);
+
+    node = tree->root;
+    for (;;) {
+        if (prefix_mismatch(node, key, depth) < node->prefix_len) {
+            goto out;
+        }
+        depth += node->prefix_len;
+
+        ref = find_slot(node, key[depth]);
+        if (!ref) {
+            goto out;
+        }
+        path[top] = node;
+        bytes[top++] = key[depth];
+
+        child = *ref;
+        if (is_leaf(child)) {
+            break;
+        }
+        node = child;
+        depth++;
+    }
+
+    if (memcmp(to_leaf(child)->key, key, len)) {
+        goto out;
+    }
+
+    /* Take the nodes left empty out together, but the root. */
+    for (d = top - 1; d > 0 && path[d]->nr == 1; d--)
+        ;
+    write_lock(path[d]);
+    node_remove(path[d], bytes[d]);
+    write_unlock(path[d]);
+
+    for (d++; d < top; d++) {
+        make_obsolete(tree, path[d]);
+    }
+    retire(tree, child);
+
+    ret = 0;
+
+out:
+    spin_unlock(&tree->lock);
+    return ret;
+}
+
+art_t *art_create(const art_ops_t *ops) {
+    art_t *tree = ops->alloc(sizeof(*tree));
+
+    memset(tree, 0, sizeof(*tree));
+    tree->ops = ops;
+    spin_lock_init(&tree->lock);
+    tree->root = node_new(tree, NODE256, NULL, 0);
+
+    return tree;
+}
+
+static void free_subtree(art_t *tree, void *p) {
+    uint8_t keys[256];
+    void *children[256];
+    unsigned nr, i;
+
+    if (!is_leaf(p)) {
+        nr = node_entries(p, keys, children);
+        for (i = 0; i < nr; i++) {
+            free_subtree(tree, children[i]);
+        }
+    }
+    free_one(tree, p);
+}
+
+/*
+ * art_gc_prepare: take the garbage so far, and return its size in @bytes.
+ * Pass it to art_gc once nobody can be reading it.
+ */
+void *art_gc_prepare(art_t *tree, size_t *bytes) {
+    struct art_gc *gc = NULL;
+    size_t i;
+
+    *bytes = 0;
+
+    spin_lock(&tree->lock);
+    if (tree->nr_gc) {
+        gc = malloc(sizeof(*gc));
+        gc->ents = tree->gc;
+        gc->nr = tree->nr_gc;
+        tree->gc = NULL;
+        tree->nr_gc = tree->gc_cap = 0;
+    }
+    spin_unlock(&tree->lock);
+
+    if (gc) {
+        for (i = 0; i < gc->nr; i++) {
+            *bytes += one_size(gc->ents[i]);
+        }
+    }
+
+    return gc;
+}
+
+/* art_gc: free the garbage taken by art_gc_prepare, return the bytes freed. */
+size_t art_gc(art_t *tree, void *p) {
+    struct art_gc *gc = p;
+    size_t i, freed = 0;
+
+    if (!gc) {
+        return 0;
+    }
+
+    for (i = 0; i < gc->nr; i++) {
+        freed += free_one(tree, gc->ents[i]);
+    }
+    free(gc->ents);
+    free(gc);
+
+    return freed;
+}
+
+void art_destroy(art_t *tree) {
+    size_t i;
+
+    free_subtree(tree, tree->root);
+
+    /* The children of the obsolete nodes were moved, or are garbage as well. */
+    for (i = 0; i < tree->nr_gc; i++) {
+        free_one(tree, tree->gc[i]);
+    }
+    free(tree->gc);
+
+    tree->ops->free(tree, sizeof(*tree));
+}
@@ -24,6 +24,7 @@
 #include "data_layer.h"
 #include "rcu.h"
 #include "counter.h"
+#include "qos.h"
 
 struct bonsai_info* bonsai;
 static char* bonsai_fpath = "/mnt/ext4/dimm0/bonsai";
@@ -48,6 +49,33 @@ pkey_t bonsai_make_key(const void *key, size_t len) {
 __thread int op_count = 0;
 __thread log_state_t dtx_lst = { .flip = OUTSIDE_DTX };
 
+/*
+ * Optimistic transactions: reads remember the version of what they read,
+ * writes are buffered. At commit, the keys to write are locked, the reads
+ * validated against the current versions, and the writes logged as one
+ * durable transaction.
+ */
+struct txn_read {
+    pkey_t k;
+    struct key_version ver;
+};
+
+struct txn_write {
+    pkey_t k;
+    pval_t v;       /* nv */
+    optype_t op;
+};
+
+static __thread struct {
+    int active;
+    struct txn_read *reads;
+    struct txn_write *writes;
+    int nr_read, nr_write;
+    int max_read, max_write;
+    /* Some write asked to be durable on commit, see @bonsai_txn_insert_sync */
+    int sync;
+} txn;
+
 static inline void try_quiescent() {
     if (op_count > RCU_MAX_OP) {
         op_count = 0;
@@ -55,6 +83,77 @@ static inline void try_quiescent() {
     }
 }
 
+/*
+ * Key locks: writers of a key hold its lock while they install its log in
+ * the shim, and a transaction holds the locks of its writes from validation
+ * to install. The logs are written before, with no key lock held. Of two
+ * logs of a key, the shim keeps the later one, whatever order they are
+ * installed in. See @bonsai_txn_commit.
+ */
+#define KEY_LOCK_BITS       10
+#define NR_KEY_LOCK         (1 << KEY_LOCK_BITS)
+
+/* A batch locks the keys of this many entries at a time, see @install_batch_locked. */
+#define KEY_LOCK_BATCH      64
+
+static struct {
+    spinlock_t lock;
+} ____cacheline_aligned key_locks[NR_KEY_LOCK];
+
+static inline unsigned key_lock_idx(pkey_t key) {
+    uint64_t h = 0, w;
+    int i;
+
+    for (i = 0; i < KEY_LEN; i += sizeof(w)) {
+        memcpy(&w, key.key + i, sizeof(w));
+        h = (h ^ w) * 0x9e3779b97f4a7c15ul;
+    }
+    return h >> (64 - KEY_LOCK_BITS);
+}
+
+static inline void key_lock(pkey_t key) {
+    spin_lock(&key_locks[key_lock_idx(key)].lock);
+}
+
+static inline void key_unlock(pkey_t key) {
+    spin_unlock(&key_locks[key_lock_idx(key)].lock);
+}
+
+static int lock_idx_cmp(const void *a, const void *b) {
+    unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Lock the keys of @n entries in order. Return the locks taken in @idx. */
+static int key_lock_many(unsigned *idx, const pentry_t *ents, int n) {
+    int i, nr = 0;
+
+    for (i = 0; i < n; i++) {
+        idx[i] = key_lock_idx(ents[i].k);
+    }
+    qsort(idx, n, sizeof(*idx), lock_idx_cmp);
+
+    for (i = 0; i < n; i++) {
+        if (!nr || idx[nr - 1] != idx[i]) {
+            idx[nr++] = idx[i];
+        }
+    }
+
+    for (i = 0; i < nr; i++) {
+        spin_lock(&key_locks[idx[i]].lock);
+    }
+
+    return nr;
+}
+
+static void key_unlock_many(const unsigned *idx, int nr) {
+    int i;
+
+    for (i = nr - 1; i >= 0; i--) {
+        spin_unlock(&key_locks[idx[i]].lock);
+    }
+}
+
 void bonsai_mark_cpu(int cpu) {
     mark_cpu(cpu);
 }
@@ -70,6 +169,10 @@ void bonsai_offline() {
 void bonsai_dtx_start() {
     /* Do not support nested durable transaction. */
     assert(dtx_lst.flip == OUTSIDE_DTX);
+    /* New logs must not mix with those of the last run. */
+    if (unlikely(LOG(bonsai)->recovery)) {
+        oplog_wait_recovery();
+    }
   	oplog_snapshot_lst(&dtx_lst);
 }
 
@@ -116,15 +219,27 @@ static inline int index_lookup(pkey_t key, pval_t *val) {
 #endif
 }
 
+/* Admission control of the local log region, see @oplog_admit. */
+static inline int admit(int n) {
+    return oplog_admit(__this->t_cpu, n, dtx_lst.flip == OUTSIDE_DTX);
+}
+
 static int do_bonsai_insert(pkey_t key, pval_t value, txop_t txop) {
   	logid_t log;
 	int ret;
 
+    ret = admit(1);
+    if (unlikely(ret)) {
+        return ret;
+    }
+
     check_dtx_autostart();
 
     log = oplog_insert(&dtx_lst, key, valman_make_nv(value), OP_INSERT, txop, __this->t_cpu);
 
+    key_lock(key);
     ret = index_upsert(key, log);
+    key_unlock(key);
 
     op_count++;
     if (txop != TX_OP) {
@@ -138,11 +253,18 @@ static int do_bonsai_remove(pkey_t key, txop_t txop) {
     logid_t log;
     int ret;
 
+    ret = admit(1);
+    if (unlikely(ret)) {
+        return ret;
+    }
+
     check_dtx_autostart();
 
     log = oplog_insert(&dtx_lst, key, 0, OP_REMOVE, txop, __this->t_cpu);
 
+    key_lock(key);
     ret = shim_upsert(&dtx_lst, key, log);
+    key_unlock(key);
 
     op_count++;
     if (txop != TX_OP) {
@@ -153,13 +275,194 @@ static int do_bonsai_remove(pkey_t key, txop_t txop) {
 }
 
 int bonsai_insert(pkey_t key, pval_t value) {
-    return do_bonsai_insert(key, value, TX_OP);
+    long start = qos_sample_begin();
+    int ret;
+
+    ret = do_bonsai_insert(key, value, TX_OP);
+    qos_sample_end(start);
+
+    return ret;
 }
 
 int bonsai_insert_commit(pkey_t key, pval_t value) {
     return do_bonsai_insert(key, value, TX_COMMIT);
 }
 
+/*
+ * Log @n sorted, distinct updates in the running durable transaction, the
+ * last one with @txop, into @logs. @ops gives the type of each, or NULL if
+ * all are inserts. The caller has been admitted.
+ */
+static void log_batch(const pentry_t *ents, const optype_t *ops, int n, txop_t txop, logid_t *logs) {
+    oplog_insert_batch(&dtx_lst, ents, ops, n, OP_INSERT, txop, __this->t_cpu, logs);
+    op_count += n;
+}
+
+/* Upsert the logged @ents into the shim with a single walk of the inode chain. */
+static void install_batch(const pentry_t *ents, const logid_t *logs, int n) {
+#ifdef DISABLE_OFFLOAD
+    int i;
+
+    for (i = 0; i < n; i++) {
+        index_upsert(ents[i].k, logs[i]);
+    }
+#else
+    shim_upsert_batch(&dtx_lst, ents, logs, n);
+#endif
+}
+
+/*
+ * Install a batch KEY_LOCK_BATCH entries at a time, taking their key locks,
+ * so that a large batch never holds much of the key lock table.
+ */
+static void install_batch_locked(const pentry_t *ents, const logid_t *logs, int n) {
+    unsigned locks[KEY_LOCK_BATCH];
+    int i, c, nr_lock;
+
+    for (i = 0; i < n; i += c) {
+        c = min(n - i, KEY_LOCK_BATCH);
+        nr_lock = key_lock_many(locks, ents + i, c);
+        install_batch(ents + i, logs + i, c);
+        key_unlock_many(locks, nr_lock);
+    }
+}
+
+/* Log @n sorted, distinct updates as one durable transaction, and install them. */
+static void write_batch(const pentry_t *ents, const optype_t *ops, int n) {
+    logid_t *logs = malloc(n * sizeof(*logs));
+
+    check_dtx_autostart();
+    log_batch(ents, ops, n, TX_COMMIT, logs);
+    install_batch_locked(ents, logs, n);
+    leave_dtx();
+
+    free(logs);
+}
+
+/*
+ * bonsai_insert_batch: insert @n key-value pairs as one durable transaction
+ * The batch is sorted (the last one wins for duplicated keys), logged in one
+ * go, and upserted into the shim with a single walk of the inode chain.
+ * Return -EAGAIN if the log region can't take it now, or -E2BIG if it
+ * never can: split the batch then.
+ */
+int bonsai_insert_batch(pkey_t *keys, pval_t *values, int n) {
+    pentry_t *ents;
+    int i, ret;
+
+    /* Before making the values, which can't be taken back. */
+    ret = admit(n);
+    if (unlikely(ret)) {
+        return ret;
+    }
+
+    ents = malloc(n * sizeof(*ents));
+    for (i = 0; i < n; i++) {
+        ents[i].k = keys[i];
+        ents[i].v = valman_make_nv(values[i]);
+    }
+    n = sort_batch(ents, n);
+
+    write_batch(ents, NULL, n);
+
+    free(ents);
+
+    return 0;
+}
+
+/*
+ * Write batches: puts and deletes collected by the caller, and applied
+ * atomically by @bonsai_write_batch, with a single commit.
+ */
+struct bonsai_write_batch {
+    struct batch_ent *ents;
+    int n, max;
+};
+
+#define WRITE_BATCH_INIT_SIZE   16
+
+struct bonsai_write_batch *bonsai_write_batch_create() {
+    return calloc(1, sizeof(struct bonsai_write_batch));
+}
+
+void bonsai_write_batch_destroy(struct bonsai_write_batch *batch) {
+    free(batch->ents);
+    free(batch);
+}
+
+void bonsai_write_batch_clear(struct bonsai_write_batch *batch) {
+    batch->n = 0;
+}
+
+int bonsai_write_batch_count(struct bonsai_write_batch *batch) {
+    return batch->n;
+}
+
+static void write_batch_add(struct bonsai_write_batch *batch, pkey_t key, pval_t value, optype_t op) {
+    struct batch_ent *e;
+
+    if (unlikely(batch->n == batch->max)) {
+        batch->max = batch->max ? batch->max * 2 : WRITE_BATCH_INIT_SIZE;
+        batch->ents = realloc(batch->ents, batch->max * sizeof(*batch->ents));
+    }
+
+    e = &batch->ents[batch->n++];
+    e->ent.k = key;
+    e->ent.v = value;
+    e->op = op;
+}
+
+/* @value is handed over once the batch is written, as with @bonsai_insert. */
+void bonsai_write_batch_put(struct bonsai_write_batch *batch, pkey_t key, pval_t value) {
+    write_batch_add(batch, key, value, OP_INSERT);
+}
+
+void bonsai_write_batch_delete(struct bonsai_write_batch *batch, pkey_t key) {
+    write_batch_add(batch, key, 0, OP_REMOVE);
+}
+
+/*
+ * bonsai_write_batch: apply the puts and deletes of @batch atomically
+ * The batch is sorted (the last update wins for duplicated keys), and
+ * logged with one TX_COMMIT: after a crash, all of it or none of it is
+ * there. It's emptied if written. Return -EAGAIN, with the batch kept,
+ * if the log region can't take it now, or -E2BIG if it never can.
+ */
+int bonsai_write_batch(struct bonsai_write_batch *batch) {
+    int i, n, ret;
+    pentry_t *ents;
+    optype_t *ops;
+
+    if (unlikely(!batch->n)) {
+        return 0;
+    }
+
+    n = batch->n = sort_write_batch(batch->ents, batch->n);
+
+    ret = admit(n);
+    if (unlikely(ret)) {
+        return ret;
+    }
+
+    ents = malloc(n * sizeof(*ents));
+    ops = malloc(n * sizeof(*ops));
+
+    for (i = 0; i < n; i++) {
+        ents[i].k = batch->ents[i].ent.k;
+        ops[i] = batch->ents[i].op;
+        ents[i].v = ops[i] == OP_INSERT ? valman_make_nv(batch->ents[i].ent.v) : 0;
+    }
+
+    write_batch(ents, ops, n);
+
+    batch->n = 0;
+
+    free(ops);
+    free(ents);
+
+    return 0;
+}
+
 int bonsai_remove(pkey_t key) {
     return do_bonsai_remove(key, TX_OP);
 }
@@ -168,14 +471,57 @@ int bonsai_remove_commit(pkey_t key) {
     return do_bonsai_remove(key, TX_COMMIT);
 }
 
+/*
+ * Durability: every log of a thread gets the next log sequence number of
+ * the thread. A write is durable once its LCB is written back, when it's
+ * full, at a checkpoint, or when asked by @bonsai_wait_durable.
+ */
+
+/* The sequence number of the last write of this thread, to wait for. */
+uint64_t bonsai_last_seq() {
+    return oplog_lsn(__this->t_cpu);
+}
+
+/* Wait till the writes of this thread up to @seq are durable. */
+void bonsai_wait_durable(uint64_t seq) {
+    oplog_sync(__this->t_cpu, seq);
+}
+
+/* Make every committed write of this thread durable. */
+void bonsai_sync() {
+    bonsai_wait_durable(bonsai_last_seq());
+}
+
+int bonsai_insert_sync(pkey_t key, pval_t value) {
+    int ret = do_bonsai_insert(key, value, TX_COMMIT);
+    bonsai_sync();
+    return ret;
+}
+
+int bonsai_remove_sync(pkey_t key) {
+    int ret = do_bonsai_remove(key, TX_COMMIT);
+    bonsai_sync();
+    return ret;
+}
+
 int bonsai_lookup(pkey_t key, pval_t *val) {
+    long start = qos_sample_begin();
     pval_t nv_val;
     int ret;
 
     assert(dtx_lst.flip == OUTSIDE_DTX);
+    assert(!txn.active);
+
+    if (unlikely(LOG(bonsai)->recovery)) {
+        ret = oplog_recovery_lookup(key, &nv_val);
+        if (ret != -EAGAIN) {
+            goto out;
+        }
+    }
 
     ret = index_lookup(key, &nv_val);
 
+out:
     if (likely(!ret)) {
         *val = valman_make_v_local(nv_val);
     }
@@ -183,12 +529,19 @@ int bonsai_lookup(pkey_t key, pval_t *val) {
     op_count++;
     try_quiescent();
 
+    qos_sample_end(start);
+
     return ret;
 }
 
 int bonsai_scan(pkey_t start, int range, pval_t *values) {
     assert(dtx_lst.flip == OUTSIDE_DTX);
 
+    /* Scans do not merge the logs of the last run, wait for the replay. */
+    if (unlikely(LOG(bonsai)->recovery)) {
+        oplog_wait_recovery();
+    }
+
 	shim_scan(start, range, values);
 
     op_count++;
@@ -197,6 +550,257 @@ int bonsai_scan(pkey_t start, int range, pval_t *values) {
 	return 0;
 }
 
+#define TXN_INIT_SIZE       16
+
+static void *txn_grow(void *arr, int *max, size_t size) {
+    *max = *max ? *max * 2 : TXN_INIT_SIZE;
+    return realloc(arr, *max * size);
+}
+
+static void txn_reset() {
+    free(txn.reads);
+    free(txn.writes);
+    memset(&txn, 0, sizeof(txn));
+}
+
+void bonsai_txn_begin() {
+    assert(!txn.active);
+    /* A transaction can't live in a durable transaction. */
+    assert(dtx_lst.flip == OUTSIDE_DTX);
+
+    /* The versions are those of the shim, wait for the logs of the last run. */
+    if (unlikely(LOG(bonsai)->recovery)) {
+        oplog_wait_recovery();
+    }
+
+    txn.active = 1;
+}
+
+static struct txn_write *txn_find_write(pkey_t key) {
+    int i;
+
+    for (i = txn.nr_write - 1; i >= 0; i--) {
+        if (!pkey_compare(txn.writes[i].k, key)) {
+            return &txn.writes[i];
+        }
+    }
+
+    return NULL;
+}
+
+int bonsai_txn_lookup(pkey_t key, pval_t *val) {
+    struct txn_write *w;
+    struct txn_read *r;
+    pval_t nv_val;
+    int ret;
+
+    assert(txn.active);
+
+    /* Read our own writes. */
+    w = txn_find_write(key);
+    if (w) {
+        if (w->op == OP_REMOVE) {
+            return -ENOENT;
+        }
+        *val = valman_make_v_local(w->v);
+        return 0;
+    }
+
+    if (unlikely(txn.nr_read == txn.max_read)) {
+        txn.reads = txn_grow(txn.reads, &txn.max_read, sizeof(*txn.reads));
+    }
+    r = &txn.reads[txn.nr_read++];
+    r->k = key;
+
+    /* A missing key is read too, its version catches an insert. */
+    ret = shim_lookup_version(key, &nv_val, &r->ver);
+    if (likely(!ret)) {
+        *val = valman_make_v_local(nv_val);
+    }
+
+    op_count++;
+    try_quiescent();
+
+    return ret;
+}
+
+static int txn_write(pkey_t key, pval_t nv_val, optype_t op) {
+    struct txn_write *w;
+
+    assert(txn.active);
+
+    w = txn_find_write(key);
+    if (w) {
+        if (w->op == OP_INSERT) {
+            valman_free_nv(w->v);
+        }
+    } else {
+        if (unlikely(txn.nr_write == txn.max_write)) {
+            txn.writes = txn_grow(txn.writes, &txn.max_write, sizeof(*txn.writes));
+        }
+        w = &txn.writes[txn.nr_write++];
+        w->k = key;
+    }
+    w->v = nv_val;
+    w->op = op;
+
+    return 0;
+}
+
+int bonsai_txn_insert(pkey_t key, pval_t value) {
+    return txn_write(key, valman_make_nv(value), OP_INSERT);
+}
+
+int bonsai_txn_remove(pkey_t key) {
+    return txn_write(key, 0, OP_REMOVE);
+}
+
+/* As above, and the commit returns once the transaction is durable. */
+int bonsai_txn_insert_sync(pkey_t key, pval_t value) {
+    txn.sync = 1;
+    return bonsai_txn_insert(key, value);
+}
+
+int bonsai_txn_remove_sync(pkey_t key) {
+    txn.sync = 1;
+    return bonsai_txn_remove(key);
+}
+
+static int key_locked_by_others(pkey_t key, const unsigned *locks, int nr_lock) {
+    unsigned idx = key_lock_idx(key);
+
+    if (nr_lock && bsearch(&idx, locks, nr_lock, sizeof(*locks), lock_idx_cmp)) {
+        return 0;
+    }
+    return spin_is_locked(&key_locks[idx].lock);
+}
+
+/*
+ * Check that no read key has been written since, and that none is being
+ * written right now. Our own key locks, sorted in @locks, are held, so of
+ * two transactions reading what the other writes, one sees the other.
+ */
+static int txn_validate(const unsigned *locks, int nr_lock) {
+    struct key_version ver;
+    struct txn_read *r;
+    pval_t val;
+    int i;
+
+    for (i = 0; i < txn.nr_read; i++) {
+        r = &txn.reads[i];
+        if (key_locked_by_others(r->k, locks, nr_lock)) {
+            return -EAGAIN;
+        }
+        shim_lookup_version(r->k, &val, &ver);
+        if (!key_version_equal(&ver, &r->ver)) {
+            return -EAGAIN;
+        }
+    }
+
+    return 0;
+}
+
+static int txn_write_cmp(const void *a, const void *b) {
+    const struct txn_write *w1 = a, *w2 = b;
+    return pkey_compare(w1->k, w2->k);
+}
+
+void bonsai_txn_rollback() {
+    int i;
+
+    assert(txn.active);
+
+    for (i = 0; i < txn.nr_write; i++) {
+        if (txn.writes[i].op == OP_INSERT) {
+            valman_free_nv(txn.writes[i].v);
+        }
+    }
+
+    txn_reset();
+}
+
+/*
+ * bonsai_txn_commit: commit the running transaction
+ * Return 0 if it is committed, or -EAGAIN if it is rolled back, because
+ * some key it read has been written since, or because the log region is
+ * full. The commit is durable on return if a write of the transaction was
+ * made by a _sync call, and later otherwise, see @bonsai_sync. Return
+ * -E2BIG, rolled back as well, if it has more writes than the log region
+ * can ever take. The writes are logged first, with no lock held. Only the validation, the TX_COMMIT (or TX_ROLLBACK)
+ * record and the install run under the key locks. The room for the record
+ * is reserved before, so that no LCB write back runs under them.
+ */
+int bonsai_txn_commit() {
+    int i, n = txn.nr_write, ret, nr_lock;
+    int cpu = __this->t_cpu;
+    pentry_t *ents;
+    optype_t *ops;
+    unsigned *locks;
+    logid_t *logs;
+
+    assert(txn.active);
+
+    if (!n) {
+        /* Read only: the reads are consistent as of the validation. */
+        ret = txn_validate(NULL, 0);
+        txn_reset();
+        return ret;
+    }
+
+    /* And the commit or rollback record. */
+    ret = admit(n + 1);
+    if (unlikely(ret)) {
+        bonsai_txn_rollback();
+        return ret;
+    }
+
+    qsort(txn.writes, n, sizeof(*txn.writes), txn_write_cmp);
+
+    ents = malloc(n * sizeof(*ents));
+    ops = malloc(n * sizeof(*ops));
+    locks = malloc(n * sizeof(*locks));
+    logs = malloc(n * sizeof(*logs));
+    for (i = 0; i < n; i++) {
+        ents[i].k = txn.writes[i].k;
+        ents[i].v = txn.writes[i].v;
+        ops[i] = txn.writes[i].op;
+    }
+
+    check_dtx_autostart();
+    log_batch(ents, ops, n, TX_OP, logs);
+
+    oplog_reserve(cpu);
+    nr_lock = key_lock_many(locks, ents, n);
+
+    ret = txn_validate(locks, nr_lock);
+    if (likely(!ret)) {
+        oplog_insert_reserved(&dtx_lst, MIN_KEY, 0, OP_NOP, TX_COMMIT, cpu);
+        install_batch(ents, logs, n);
+    } else {
+        /* The checkpoint drops the logs up to the TX_ROLLBACK. */
+        oplog_insert_reserved(&dtx_lst, MIN_KEY, 0, OP_NOP, TX_ROLLBACK, cpu);
+    }
+    key_unlock_many(locks, nr_lock);
+    oplog_reserve_done(cpu);
+
+    leave_dtx();
+    if (unlikely(ret)) {
+        bonsai_txn_rollback();
+    } else {
+        if (txn.sync) {
+            bonsai_sync();
+        }
+        txn_reset();
+    }
+
+    free(logs);
+    free(locks);
+    free(ops);
+    free(ents);
+
+    return ret;
+}
+
 void bonsai_barrier() {
     atomic_set(&bonsai->l_layer.force_flush, 1);
     do {
@@ -215,6 +819,11 @@ void bonsai_deinit() {
 #ifdef ASYNC_SMO
   bonsai_smo_thread_exit();
 #endif
+
+#ifdef ENABLE_INDEX_IMAGE
+	/* A clean shutdown leaves an up-to-date image for a fast restart. */
+	index_image_dump();
+#endif
 	
 	index_layer_deinit(&bonsai->i_layer);
   log_layer_deinit(&bonsai->l_layer);
@@ -228,7 +837,7 @@ void bonsai_deinit() {
 
 int bonsai_init(char *index_name, init_func_t init, destory_func_t destory, insert_func_t insert, update_func_t update,
                 remove_func_t remove, lookup_func_t lookup, scan_func_t scan) {
-	int error = 0, fd;
+	int error = 0, fd, format;
     pnoid_t sentinel;
 	char *addr;
 
@@ -257,49 +866,58 @@ int bonsai_init(char *index_name, init_func_t init, destory_func_t destory, inse
 	bonsai->fd = fd;
 	bonsai->desc = (struct bonsai_desc*)addr;
 
-    /* TODO: Recovery */
-    bonsai->desc->init = 0;
-
-  	if (!bonsai->desc->init) {
-		/* 1. initialize index layer */
-		index_layer_init(index_name, &bonsai->i_layer, init, 
-						 insert, update, remove, lookup, scan, destory);
-
-		/* 2. initialize log layer */
-    	error = log_layer_init(&bonsai->l_layer);
-		if (error)
-			goto out;
-
-		/* 3. initialize data layer */
-    	error = data_layer_init(&bonsai->d_layer);
-		if (error)
-			goto out;
-
-		/* 4. initialize self */
-		INIT_LIST_HEAD(&bonsai->thread_list);
-		bonsai_self_thread_init();
-		
-		/* 5. initialize sentinel nodes */
-    	sentinel = pnode_sentinel_init();
-    	shim_sentinel_init(sentinel);
+	format = !bonsai->desc->init;
 
-		/* 6. initialize RCU */
-		rcu_init(&bonsai->rcu);
-		fb_init(&bonsai->rcu.fb);
+	/* 1. initialize index layer */
+	index_layer_init(index_name, &bonsai->i_layer, init, 
+					 insert, update, remove, lookup, scan, destory);
 
-		/* 7. initialize durable transaction */
-		atomic_set(&bonsai->tx_id, 0);
+	/* 2. initialize log layer */
+	error = log_layer_init(&bonsai->l_layer, format);
+	if (error)
+		goto out;
 
+	/* 3. initialize data layer */
+	error = data_layer_init(&bonsai->d_layer, format);
+	if (error)
+		goto out;
+
+	/* 4. initialize self */
+	INIT_LIST_HEAD(&bonsai->thread_list);
+	bonsai_self_thread_init();
+
+	/* 5. initialize RCU */
+	rcu_init(&bonsai->rcu);
+	fb_init(&bonsai->rcu.fb);
+
+	/* 6. initialize durable transaction */
+	atomic_set(&bonsai->tx_id, 0);
+
+  	if (format) {
+		/* 7. initialize sentinel nodes */
+    	sentinel = pnode_sentinel_init();
+    	shim_sentinel_init(sentinel);
+
+		bonsai->desc->epoch = 0;
 		bonsai->desc->init = 1;
+		bonsai_flush(bonsai->desc, CACHELINE_SIZE, 1);
   	} else {
+		/* 7. rebuild from the pnodes of the last run */
       	bonsai_recover();
   	}
 
-	bonsai->desc->epoch = 0;
-
-	/* 6. initialize pflush thread */
+	/* 8. initialize pflush thread */
 	bonsai_pflushd_thread_init();
 
+	/* 9. let the pflush threads rebuild the index and replay the logs */
+	while (ACCESS_ONCE(bonsai->l_layer.recovery) == RECOVERY_FETCH) {
+		wakeup_master();
+		usleep(100);
+	}
+#ifndef LAZY_RECOVERY
+	oplog_wait_recovery();
+#endif
+
 #ifdef ASYNC_SMO
 	bonsai_smo_thread_init();
 #endif
@@ -310,6 +928,11 @@ out:
 	return error;
 }
 
+/* Let the index free the nodes it unlinks, see @index_layer_gc. */
+void bonsai_set_index_gc(gc_prepare_func_t prepare, gc_func_t gc) {
+	index_layer_set_gc(&bonsai->i_layer, prepare, gc);
+}
+
 size_t get_inode_size();
 size_t get_cnode_size();
 
@@ -0,0 +1,234 @@
+/*
+ * BonsaiKV: Towards Fast, Scalable, and Persistent Key-Value Stores with Tiered, Heterogeneous Memory System
+ *
+ * Checkpoint policy: when the pflush master should checkpoint
+ */
+
+#define _GNU_SOURCE
+#include "cpu.h"
+#include <time.h>
+
+#include "bonsai.h"
+#include "log_layer.h"
+#include "counter.h"
+#include "thread.h"
+#include "chkpt.h"
+
+int chkpt_trigger_nlog = CHKPT_NLOG_INTERVAL;
+
+size_t get_inode_size();
+
+/* Only the master touches it. */
+static struct {
+    struct chkpt_stat stat;
+
+    /* At the last poll */
+    int nlog;
+    unsigned long nr_log_hit, nr_pnode_hit;
+    int idle_polls;
+
+    /* At the last checkpoint */
+    int nr_ino;
+    long time;
+} policy = {
+    .stat.trigger_nlog = CHKPT_NLOG_INTERVAL
+};
+
+static const char *reason_str[NR_CHKPT_REASON] = {
+    [CHKPT_NONE]        = "none",
+    [CHKPT_FORCED]      = "forced",
+    [CHKPT_NLOG]        = "backlog",
+    [CHKPT_OCCUPANCY]   = "occupancy",
+    [CHKPT_INODE]       = "inodes",
+    [CHKPT_READS]       = "reads",
+    [CHKPT_IDLE]        = "idle",
+    [CHKPT_AGE]         = "age",
+};
+
+const char *chkpt_reason_str(enum chkpt_reason reason) {
+    return reason_str[reason];
+}
+
+static long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Return the logs not checkpointed yet, and the most of one CPU in @max_nlog. */
+static int backlog(int *max_nlog) {
+    struct log_layer *layer = LOG(bonsai);
+    int cpu, nr, total = 0;
+
+    *max_nlog = 0;
+    for (cpu = 0; cpu < NUM_CPU; cpu++) {
+        nr = (int) atomic_read(&layer->nlogs[cpu].cnt);
+        total += nr;
+        if (nr > *max_nlog) {
+            *max_nlog = nr;
+        }
+    }
+    return total;
+}
+
+/* How long the master sleeps at most, or 0 till somebody wakes it up. */
+long chkpt_poll_time() {
+#ifdef ADAPTIVE_CHKPT
+    return CHKPT_POLL_TIME;
+#else
+    return 0;
+#endif
+}
+
+#ifdef ADAPTIVE_CHKPT
+
+/*
+ * Sample the foreground since the last poll: the write rate sets the
+ * trigger, so that a burst makes larger checkpoints rather than many small
+ * ones, the lookups tell where reads go, and few ops mean idle.
+ */
+static void chkpt_poll(int nlog) {
+    unsigned long nr_log_hit = COUNTER_GET(nr_log_hit), nr_pnode_hit = COUNTER_GET(nr_pnode_hit);
+    unsigned long reads, log_reads;
+    long writes, trigger;
+
+    writes = nlog > policy.nlog ? nlog - policy.nlog : 0;
+    log_reads = nr_log_hit - policy.nr_log_hit;
+    reads = log_reads + nr_pnode_hit - policy.nr_pnode_hit;
+
+    policy.nlog = nlog;
+    policy.nr_log_hit = nr_log_hit;
+    policy.nr_pnode_hit = nr_pnode_hit;
+
+    policy.stat.log_hit_pct = reads >= CHKPT_MIN_READS ? (unsigned) (log_reads * 100 / reads) : 0;
+
+    if (writes + reads < CHKPT_IDLE_OPS) {
+        policy.idle_polls++;
+    } else {
+        policy.idle_polls = 0;
+    }
+    policy.stat.idle = policy.idle_polls >= CHKPT_IDLE_POLLS;
+
+    trigger = writes * CHKPT_BATCH_POLLS;
+    if (trigger < CHKPT_NLOG_INTERVAL) {
+        trigger = CHKPT_NLOG_INTERVAL;
+    }
+    if (trigger > CHKPT_MAX_NLOG) {
+        trigger = CHKPT_MAX_NLOG;
+    }
+    /* Follow the rate, but not a single spike. */
+    policy.stat.trigger_nlog = (int) ((policy.stat.trigger_nlog * 3 + trigger) / 4);
+    ACCESS_ONCE(chkpt_trigger_nlog) = policy.stat.trigger_nlog;
+
+    policy.stat.nr_poll++;
+}
+
+static enum chkpt_reason do_chkpt_decide(int nlog, int max_nlog, int timeout) {
+    size_t ino_mem;
+
+    if (!nlog) {
+        return CHKPT_NONE;
+    }
+
+    if (max_nlog >= CHKPT_MAX_CPU_NLOG) {
+        return CHKPT_OCCUPANCY;
+    }
+
+    if (nlog >= policy.stat.trigger_nlog) {
+        return CHKPT_NLOG;
+    }
+
+    ino_mem = (size_t) max(COUNTER_GET(nr_ino) - policy.nr_ino, 0) * get_inode_size();
+    if (ino_mem >= CHKPT_INODE_MEM) {
+        return CHKPT_INODE;
+    }
+
+    if (nlog >= CHKPT_MIN_NLOG && policy.stat.log_hit_pct >= CHKPT_LOG_HIT_PCT) {
+        return CHKPT_READS;
+    }
+
+    if (policy.stat.idle) {
+        return CHKPT_IDLE;
+    }
+
+    if (now_us() - policy.time >= CHKPT_TIME_INTERVAL) {
+        return CHKPT_AGE;
+    }
+
+    policy.stat.nr_deferred++;
+    return CHKPT_NONE;
+}
+
+#else
+
+static enum chkpt_reason do_chkpt_decide(int nlog, int max_nlog, int timeout) {
+    if (nlog >= CHKPT_NLOG_INTERVAL) {
+        return CHKPT_NLOG;
+    }
+
+    return CHKPT_NONE;
+}
+
+#endif
+
+/*
+ * chkpt_decide: whether the master should checkpoint now, and why
+ * @timeout: the master woke up by itself, after chkpt_poll_time()
+ */
+enum chkpt_reason chkpt_decide(int timeout) {
+    struct log_layer *layer = LOG(bonsai);
+    enum chkpt_reason reason;
+    int nlog, max_nlog;
+
+    nlog = backlog(&max_nlog);
+
+    if (timeout) {
+#ifdef ADAPTIVE_CHKPT
+        chkpt_poll(nlog);
+#else
+        policy.stat.nr_poll++;
+#endif
+    }
+
+    if (unlikely(atomic_read(&layer->force_flush))) {
+        reason = CHKPT_FORCED;
+    } else {
+        reason = do_chkpt_decide(nlog, max_nlog, timeout);
+    }
+
+    if (reason != CHKPT_NONE) {
+        policy.stat.nr_chkpt[reason]++;
+        bonsai_print("checkpoint policy: %s, %d logs, up to %d per cpu\n", chkpt_reason_str(reason), nlog, max_nlog);
+    }
+
+    return reason;
+}
+
+/* A checkpoint is done (or the master just started), measure from here. */
+void chkpt_done() {
+    int max_nlog;
+
+    policy.nlog = backlog(&max_nlog);
+    policy.nr_ino = COUNTER_GET(nr_ino);
+    policy.time = now_us();
+}
+
+void chkpt_stat(struct chkpt_stat *stat) {
+    *stat = policy.stat;
+    stat->trigger_nlog = ACCESS_ONCE(chkpt_trigger_nlog);
+}
+
+void chkpt_dump_stat() {
+    struct chkpt_stat stat;
+    int i;
+
+    chkpt_stat(&stat);
+
+    bonsai_print("checkpoint policy: %lu polls, %lu deferred, trigger %d logs, %u%% reads in logs, %s\n",
+                 stat.nr_poll, stat.nr_deferred, stat.trigger_nlog, stat.log_hit_pct, stat.idle ? "idle" : "busy");
+    for (i = CHKPT_NONE + 1; i < NR_CHKPT_REASON; i++) {
+        if (stat.nr_chkpt[i]) {
+            bonsai_print("checkpoint policy: %lu checkpoints for %s\n", stat.nr_chkpt[i], chkpt_reason_str(i));
+        }
+    }
+}
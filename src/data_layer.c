@@ -28,6 +28,9 @@
 
 #define PNODE_NUM               (DATA_REGION_SIZE / NUM_DIMM_PER_SOCKET / PNODE_INTERLEAVING_SIZE)
 
+/* How far the persistent high water mark is pushed each time it is crossed. */
+#define PNODE_HWM_STEP          4096
+
 struct oplog;
 
 typedef struct mnode {
@@ -244,6 +247,36 @@ static pentry_t *pnode_ent(pnoid_t pno, unsigned i, int replica) {
     return ent;
 }
 
+static void set_sentinel(struct data_layer *layer, pnoid_t sentinel) {
+    layer->sentinel = sentinel;
+    bonsai->desc->pnode_sentinel = sentinel;
+    bonsai_flush(&bonsai->desc->pnode_sentinel, sizeof(__le32), 1);
+}
+
+/*
+ * Pnodes at or above the persistent high water mark have never been handed
+ * out, so their @u.node still holds the free list link written at format
+ * time. Recovery trusts that part of the free list and rebuilds the rest.
+ * The mark must be durable before anything below it gets modified.
+ */
+static void pnode_raise_hwm(uint32_t blk_nr) {
+    struct data_layer *layer = DATA(bonsai);
+    uint32_t hwm;
+
+    if (likely(blk_nr < ACCESS_ONCE(layer->hwm))) {
+        return;
+    }
+
+    spin_lock(&layer->hwm_lock);
+    if (blk_nr >= layer->hwm) {
+        hwm = blk_nr + PNODE_HWM_STEP < PNODE_NUM ? blk_nr + PNODE_HWM_STEP : PNODE_NUM;
+        bonsai->desc->pnode_hwm = hwm;
+        bonsai_flush(&bonsai->desc->pnode_hwm, sizeof(__le32), 1);
+        ACCESS_ONCE(layer->hwm) = hwm;
+    }
+    spin_unlock(&layer->hwm_lock);
+}
+
 static pnoid_t alloc_pnode(int node) {
     struct data_layer *d_layer = DATA(bonsai);
     union pnoid_u id;
@@ -252,10 +285,12 @@ static pnoid_t alloc_pnode(int node) {
     do {
         id.id = ACCESS_ONCE(d_layer->free_list);
     } while (!cmpxchg2(&d_layer->free_list, id.id, (mno = pnode_meta(id.id))->u.node));
+    pnode_raise_hwm(id.blk_nr);
     id.numa_node = node;
 
-    mno->node_version = 1;
-    mno->perm_version = 0;
+    /* Move on from the last use, a version must not come back, see @pnode_version. */
+    mno->node_version++;
+    mno->perm_version = mno->node_version - 1;
     spin_lock_init(&mno->perm_lock);
     seqcount_init(&mno->perm_seq);
 
@@ -432,11 +467,14 @@ done:
 
 	lmno->u.prev = mno->u.prev;
     rmno->next = mno->next;
+    bonsai_flush(&rmno->next, sizeof(pnoid_t), 1);
 
     if (likely(mno->u.prev != PNOID_NULL)) {
         pnode_meta(mno->u.prev)->next = l;
+        /* The durability point. */
+        bonsai_flush(&pnode_meta(mno->u.prev)->next, sizeof(pnoid_t), 1);
     } else {
-        layer->sentinel = l;
+        set_sentinel(layer, l);
     }
 
 	if (likely(mno->next != PNOID_NULL)) {
@@ -670,7 +708,8 @@ static void pnode_prebuild(pnoid_t *start, pnoid_t *end, pnoid_t pnode, struct l
     bonsai_flush(&tail_mno->next, sizeof(pnoid_t), 1);
 
     if (unlikely(prev == PNOID_NULL)) {
-        d_layer->sentinel = head;
+        /* The durability point. */
+        set_sentinel(d_layer, head);
     } else {
         mno = pnode_meta(prev);
         mno->next = head;
@@ -753,6 +792,11 @@ int pnode_lookup(pnoid_t pnode, pkey_t key, pval_t *val) {
     return ret;
 }
 
+/* Bumped after every change of the entries, see @shim_lookup_version. */
+int pnode_version(pnoid_t pnode) {
+    return ACCESS_ONCE(pnode_meta(pnode)->node_version);
+}
+
 int is_in_pnode(pnoid_t pnode, pkey_t key) {
     mnode_t *mno = pnode_meta(pnode);
     return pkey_compare(key, mno->lfence) >= 0 && pkey_compare(key, mno->rfence) < 0;
@@ -856,18 +900,118 @@ get_entries:
     return cnt;
 }
 
-static void init_pnode_pool(struct data_layer *layer) {
+static void init_pnode_pool(struct data_layer *layer, int format) {
+    mnode_t *mno;
     pnoid_t cur;
 
-    for (cur = 0; cur < PNODE_NUM; cur++) {
-        pnode_meta(cur)->u.node = cur + 1 < PNODE_NUM ? cur + 1 : PNOID_NULL;
+    if (format) {
+        for (cur = 0; cur < PNODE_NUM; cur++) {
+            mno = pnode_meta(cur);
+            mno->u.node = cur + 1 < PNODE_NUM ? cur + 1 : PNOID_NULL;
+            bonsai_flush(&mno->u.node, sizeof(pnoid_t), 0);
+        }
+        bonsai->desc->pnode_sentinel = PNOID_NULL;
+        bonsai->desc->pnode_hwm = 0;
+        bonsai_flush(bonsai->desc, CACHELINE_SIZE, 1);
+        layer->free_list = 0;
+    } else {
+        /* Rebuilt by @pnode_recover. */
+        layer->free_list = PNOID_NULL;
     }
-    layer->free_list = 0;
+    layer->hwm = bonsai->desc->pnode_hwm;
+    spin_lock_init(&layer->hwm_lock);
     layer->tofree_head = layer->tofree_tail = PNOID_NULL;
 
     layer->cnodes = malloc(sizeof(*layer->cnodes) * PNODE_NUM);
 }
 
+static int pnode_list_collect(pnoid_t **pnos) {
+    int nr_pno = 0, cap = 1024;
+    pnoid_t pno;
+
+    *pnos = malloc(cap * sizeof(pnoid_t));
+
+    for (pno = bonsai->desc->pnode_sentinel; pno != PNOID_NULL; pno = pnode_meta(pno)->next) {
+        if (unlikely(nr_pno == cap)) {
+            cap *= 2;
+            *pnos = realloc(*pnos, cap * sizeof(pnoid_t));
+        }
+        (*pnos)[nr_pno++] = pno;
+    }
+
+    return nr_pno;
+}
+
+/*
+ * Recover the pnode list after restart into @rebuild_pnos for the parallel
+ * rebuild (see @pnode_restore), and rebuild the free list. @pnos is the list
+ * in order if already known (taken over), or NULL to walk it on NVM. Pnodes
+ * allocated but not yet linked when we crashed are simply not on the list,
+ * so they go back to the free list here.
+ */
+pnoid_t pnode_recover(pnoid_t *pnos, int nr_pno) {
+    struct data_layer *layer = DATA(bonsai);
+    uint32_t hwm = layer->hwm, blk;
+    unsigned long *used;
+    union pnoid_u u;
+    int i;
+
+    if (!pnos) {
+        nr_pno = pnode_list_collect(&pnos);
+    }
+    layer->rebuild_pnos = pnos;
+    layer->nr_rebuild_pno = nr_pno;
+
+    used = calloc((PNODE_NUM + BITS_PER_LONG - 1) / BITS_PER_LONG, sizeof(unsigned long));
+
+    for (i = 0; i < nr_pno; i++) {
+        u.id = pnos[i];
+        __set_bit(u.blk_nr, used);
+        if (unlikely(u.blk_nr >= hwm)) {
+            hwm = u.blk_nr + 1;
+        }
+    }
+
+    /* Chain all the unused pnodes below @hwm in front of the untouched part. */
+    layer->free_list = hwm < PNODE_NUM ? hwm : PNOID_NULL;
+    for (blk = hwm; blk-- > 0; ) {
+        if (!test_bit(blk, used)) {
+            pnode_meta(blk)->u.node = layer->free_list;
+            layer->free_list = blk;
+        }
+    }
+
+    free(used);
+
+    set_sentinel(layer, bonsai->desc->pnode_sentinel);
+
+    COUNTER_ADD(nr_pno, nr_pno);
+
+    bonsai_print("pnode_recover: %d pnodes, hwm %u\n", nr_pno, hwm);
+
+    return layer->sentinel;
+}
+
+/*
+ * Restore the volatile state of a listed pnode: @prev link, locks, the DRAM
+ * cnode and the sorted permutation. Pnodes are independent of each other here.
+ */
+void pnode_restore(pnoid_t pnode, pnoid_t prev) {
+    mnode_t *mno = pnode_meta(pnode);
+    cnode_t *cno = get_cnode(pnode);
+
+    mno->u.prev = prev;
+    mno->node_version = 1;
+    mno->perm_version = 0;
+    spin_lock_init(&mno->perm_lock);
+    seqcount_init(&mno->perm_seq);
+
+    cno->validmap = mno->validmap;
+    memcpy(cno->fgprt, mno->fgprt, sizeof(cno->fgprt));
+
+    generate_perm_arr(pnode, 1);
+}
+
 #ifdef ENABLE_PNODE_REPLICA
 
 static void timer_handler(int sig) {
@@ -916,7 +1060,7 @@ void end_invalidate_unref_entries(const unsigned *since) {
 
 #endif
 
-int data_layer_init(struct data_layer *layer) {
+int data_layer_init(struct data_layer *layer, int format) {
     size_t size = (DATA_REGION_SIZE / sizeof(pentry_t)) * sizeof(unsigned);
     int numa_node, ret;
     unsigned *tab;
@@ -930,10 +1074,10 @@ int data_layer_init(struct data_layer *layer) {
         goto out;
     }
 	
-    init_pnode_pool(layer);
+    init_pnode_pool(layer, format);
 
 #ifdef STR_VAL
-    valman_vpool_init();
+    valman_vpool_init(format);
 #endif
 
 #ifdef ENABLE_PNODE_REPLICA
@@ -948,7 +1092,9 @@ int data_layer_init(struct data_layer *layer) {
 
     spin_lock_init(&layer->plist_lock);
 
-    layer->sentinel = PNOID_NULL;
+    layer->sentinel = format ? PNOID_NULL : bonsai->desc->pnode_sentinel;
+    layer->rebuild_pnos = NULL;
+    layer->nr_rebuild_pno = 0;
 
 	bonsai_print("data_layer_init\n");
 
@@ -970,6 +1116,8 @@ pnoid_t pnode_sentinel_init() {
     mno->u.prev = mno->next = PNOID_NULL;
     mno->lfence = MIN_KEY;
     mno->rfence = MAX_KEY;
+    pnode_persist(pno, 1);
+    set_sentinel(DATA(bonsai), pno);
     return pno;
 }
 
@@ -33,21 +33,31 @@
 /* Index Node: 2 cachelines */
 typedef struct inode {
     /* header, 6-8 words */
-    uint16_t validmap;
-    uint8_t  cpu;
-    uint8_t  deleted;
     union {
         struct {
-            uint16_t flipmap;
-            uint16_t has_pfence;
+            uint16_t validmap;
+            /* Slots taken by the lock-free inserts, not valid yet */
+            uint16_t claimmap;
         };
-        uint32_t next_free;
+        uint32_t slotmap;
     };
+    uint16_t flipmap;
+    uint8_t  cpu;
+    uint8_t  deleted: 1;
+    uint8_t  has_pfence: 1;
 
     uint32_t next;
     pnoid_t  pno;
 
-    uint8_t  fgprt[INODE_FANOUT];
+    /*
+     * The fingerprints are only hints, so they can take the free list link.
+     * The lock-free inserts and the readers may still look at a deleted
+     * inode, and must see its validmap and logs intact.
+     */
+    union {
+        uint8_t  fgprt[INODE_FANOUT];
+        uint32_t next_free;
+    };
 
     pkey_t   rfence;
 #ifndef STR_KEY
@@ -91,6 +101,23 @@ struct inoid {
     };
 } __packed;
 
+/* A range of the pnode list to rebuild after restart, see @shim_rebuild_init. */
+struct rebuild_range {
+    spinlock_t lock;
+    int done;
+    inode_t *placeholder;
+    const pnoid_t *pnos;
+    int from, to;
+};
+
+static struct rebuild_range *rebuild_ranges;
+/* Range ids sorted by placeholder, see @shim_materialize */
+static int *rebuild_order;
+static int nr_rebuild_range;
+static atomic_t nr_unmaterialized;
+
+static int shim_materialize(inode_t *inode);
+
 static inline uint32_t get_inoid(int cpu, uint32_t off) {
     struct inoid id = { .cpu = cpu, .off = off };
     return id.inoid;
@@ -136,30 +163,75 @@ static inline void unpack_pptr(inode_t **inode, pnoid_t *pnode, void *pptr) {
     *pnode = p.pnode;
 }
 
-void do_smo() {
+static unsigned long smo_watermark() {
+    struct shim_layer *s_layer = SHIM(bonsai);
+    unsigned long wmark = ULONG_MAX, ts;
+    int cpu;
+
+    for (cpu = 0; cpu < NUM_CPU; cpu++) {
+        ts = ACCESS_ONCE(s_layer->wmark[cpu].ts);
+        if (ts < wmark) {
+            wmark = ts;
+        }
+    }
+
+    return wmark;
+}
+
+/* Peek the oldest SMO queued for @part, and return its producer, or -1. */
+static int smo_peek(int part, struct smo_log *log) {
+    struct shim_layer *s_layer = SHIM(bonsai);
+    unsigned long min_ts = ULONG_MAX;
+    int cpu, min_cpu = -1;
+    struct smo_log t;
+
+    for (cpu = 0; cpu < NUM_CPU; cpu++) {
+        if (kfifo_peek(&s_layer->fifo[part][cpu], &t)) {
+            if (t.ts <= min_ts) {
+                min_ts = t.ts;
+                min_cpu = cpu;
+                *log = t;
+            }
+        }
+    }
+
+    return min_cpu;
+}
+
+int smo_pending(int part) {
+    struct smo_log log;
+    return smo_peek(part, &log) >= 0;
+}
+
+/*
+ * do_smo: apply the SMOs of partition @part in timestamp order
+ * A producer may still hold back an older SMO of the same key, so wait
+ * till the oldest one queued is below the watermark. An SMO flushed
+ * before we read the watermark shows up when we peek again.
+ */
+void do_smo(int part) {
     struct index_layer *i_layer = INDEX(bonsai);
     struct shim_layer* s_layer = SHIM(bonsai);
-    unsigned long min_ts;
-    struct smo_log log = {0};
-    int cpu, min_cpu;
+    struct smo_log log = {0}, t;
+    int cpu;
 
     while (1) {
-        min_ts = ULONG_MAX;
-        min_cpu = -1;
-        for (cpu = 0; cpu < NUM_CPU; cpu++) {
-            if (kfifo_peek(&s_layer->fifo[cpu], &log)) {
-                if (log.ts <= min_ts) {
-                    min_ts = log.ts;
-                    min_cpu = cpu;
-                }
-            }
+        cpu = smo_peek(part, &log);
+        if (unlikely(cpu == -1)) {
+            break;
         }
 
-        if (unlikely(min_cpu == -1)) {
-            break;
+        smp_rmb();
+        if (unlikely(smo_watermark() < log.ts)) {
+            cpu_relax();
+            continue;
+        }
+        smp_rmb();
+        if (unlikely(smo_peek(part, &t) >= 0 && t.ts < log.ts)) {
+            continue;
         }
 
-        kfifo_get(&s_layer->fifo[min_cpu], &log);
+        kfifo_get(&s_layer->fifo[part][cpu], &log);
 
         if (log.v) {
             i_layer->insert(i_layer->index_struct, pkey_to_str(log.k).key, KEY_LEN, log.v);
@@ -169,23 +241,78 @@ void do_smo() {
     }
 }
 
+#ifdef ASYNC_SMO
+
+/* SMOs held back by this thread, in timestamp order */
+static __thread struct smo_log smo_batch[SMO_BATCH_SIZE];
+static __thread int smo_nr_batch;
+
+/* All the SMOs of a key go through the same SMO thread. */
+static inline int smo_part(pkey_t k) {
+    unsigned long h = 0, w;
+    int i;
+
+    for (i = 0; i < KEY_LEN; i += sizeof(w)) {
+        memcpy(&w, k.key + i, sizeof(w));
+        h = (h ^ w) * 0x9e3779b97f4a7c15ul;
+    }
+
+    return (int) ((h >> 32) % NUM_SMO_THREAD);
+}
+
+/*
+ * smo_flush: publish the SMOs held back by this thread
+ * Call it when done with the shim. Each SMO thread is woken up once, and
+ * the watermark follows the SMOs out, so that the SMO threads are never
+ * held back by what is queued already.
+ */
+static void smo_flush() {
+    struct shim_layer *s_layer = SHIM(bonsai);
+    unsigned long *wmark = &s_layer->wmark[__this->t_cpu].ts;
+    unsigned long woken = 0;
+    int i, part;
+
+    for (i = 0; i < smo_nr_batch; i++) {
+        part = smo_part(smo_batch[i].k);
+        while (unlikely(!kfifo_put(&s_layer->fifo[part][__this->t_cpu], smo_batch[i]))) {
+            wakeup_smo(part);
+            cpu_relax();
+        }
+        smp_wmb();
+        ACCESS_ONCE(*wmark) = i + 1 < smo_nr_batch ? smo_batch[i + 1].ts : ULONG_MAX;
+        __set_bit(part, &woken);
+    }
+    smo_nr_batch = 0;
+
+    for_each_set_bit(part, &woken, NUM_SMO_THREAD) {
+        wakeup_smo(part);
+    }
+}
+
 static void smo_append(pkey_t k, void *v) {
     struct shim_layer *s_layer = SHIM(bonsai);
     unsigned long ts;
-    int ret;
 
     ts = ordo_new_clock(0);
 
-retry:
-    ret = kfifo_put(&s_layer->fifo[__this->t_cpu], ((struct smo_log) { ts, k, v }));
-    if (unlikely(!ret)) {
-        wakeup_smo();
-        goto retry;
+    if (!smo_nr_batch) {
+        /* Before the inode locks are released, see @do_smo. */
+        ACCESS_ONCE(s_layer->wmark[__this->t_cpu].ts) = ts;
+        barrier();
     }
 
-    wakeup_smo();
+    smo_batch[smo_nr_batch++] = (struct smo_log) { ts, k, v };
+    if (unlikely(smo_nr_batch == SMO_BATCH_SIZE)) {
+        smo_flush();
+    }
 }
 
+#else
+
+static inline void smo_flush() { }
+
+#endif
+
 static inline int index_upsert(pkey_t k, void *v) {
 #ifdef ASYNC_SMO
     smo_append(k, v);
@@ -212,9 +339,15 @@ static inline inode_t *inode_seek(pkey_t key, int may_lookup_pnode, pkey_t *ilfe
     pnoid_t pnode;
     void *pptr;
 
+relookup:
     pptr = i_layer->lookup(i_layer->index_struct, pkey_to_str(key).key, KEY_LEN, ilfence ? ilfence->key : NULL);
     unpack_pptr(&inode, &pnode, pptr);
 
+    /* Hit a range not rebuilt yet after restart. */
+    if (unlikely(atomic_read(&nr_unmaterialized)) && shim_materialize(inode)) {
+        goto relookup;
+    }
+
     if (ilfence) {
         *ilfence = str_to_pkey(*ilfence);
     }
@@ -230,20 +363,23 @@ static inline inode_t *inode_seek(pkey_t key, int may_lookup_pnode, pkey_t *ilfe
 
 static inline void inode_lock(inode_t *inode) {
     mcs4_lock(&inode->lock);
+#ifdef OPTIMISTIC_UPSERT
+    /* Let the lock-free inserts in flight finish, see @inode_insert_lockfree. */
+    while (unlikely(ACCESS_ONCE(inode->claimmap))) {
+        cpu_relax();
+    }
+#endif
 }
 
 static inline void inode_unlock(inode_t *inode) {
     mcs4_unlock(&inode->lock);
 }
 
-static int inode_crab_and_lock(inode_t **inode, pkey_t key, pkey_t *ilfence) {
+/*
+ * Move the lock on *@inode rightwards until it covers @key.
+ */
+static void inode_crab(inode_t **inode, pkey_t key, pkey_t *ilfence) {
     inode_t *target;
-    inode_lock(*inode);
-    if (unlikely((*inode)->deleted)) {
-        /* It's deleted. */
-        inode_unlock(*inode);
-        return -EAGAIN;
-    }
     while (pkey_compare(key, (*inode)->rfence) >= 0) {
         if (ilfence) {
             *ilfence = (*inode)->rfence;
@@ -258,6 +394,16 @@ static int inode_crab_and_lock(inode_t **inode, pkey_t key, pkey_t *ilfence) {
         inode_unlock(*inode);
         *inode = target;
     }
+}
+
+static int inode_crab_and_lock(inode_t **inode, pkey_t key, pkey_t *ilfence) {
+    inode_lock(*inode);
+    if (unlikely((*inode)->deleted)) {
+        /* It's deleted. */
+        inode_unlock(*inode);
+        return -EAGAIN;
+    }
+    inode_crab(inode, key, ilfence);
     return 0;
 }
 
@@ -306,7 +452,7 @@ static inline void inode_free(struct inode_recycle_chain *rec, inode_t *inode) {
 
 static int shim_layer_init() {
     struct shim_layer *layer = SHIM(bonsai);
-    int cpu;
+    int cpu, part;
 
     layer->pool = memalign(CACHE_LINE_PREFETCH_UNIT * L1_CACHE_BYTES, NUM_CPU * sizeof(struct inode_pool));
     for (cpu = 0; cpu < NUM_CPU; cpu++) {
@@ -316,8 +462,13 @@ static int shim_layer_init() {
 	
     atomic_set(&layer->exit, 0);
 
+    for (part = 0; part < NUM_SMO_THREAD; part++) {
+        for (cpu = 0; cpu < NUM_CPU; cpu++) {
+            INIT_KFIFO(layer->fifo[part][cpu]);
+        }
+    }
     for (cpu = 0; cpu < NUM_CPU; cpu++) {
-        INIT_KFIFO(layer->fifo[cpu]);
+        layer->wmark[cpu].ts = ULONG_MAX;
     }
 	
 	bonsai_print("shim_layer_init\n");
@@ -325,34 +476,45 @@ static int shim_layer_init() {
     return 0;
 }
 
-int shim_sentinel_init(pnoid_t sentinel_pnoid) {
+/*
+ * leader_inode_create: create an empty leader inode covering @pno
+ */
+static inode_t *leader_inode_create(pnoid_t pno, pkey_t lfence, pkey_t rfence) {
     struct index_layer *i_layer = INDEX(bonsai);
-    struct shim_layer *s_layer = SHIM(bonsai);
     inode_t *inode;
     void *pptr;
 
     inode = inode_alloc();
 
-    pack_pptr(&pptr, inode, sentinel_pnoid);
-    i_layer->insert(i_layer->index_struct, pkey_to_str(MIN_KEY).key, KEY_LEN, pptr);
+    pack_pptr(&pptr, inode, pno);
+    i_layer->insert(i_layer->index_struct, pkey_to_str(lfence).key, KEY_LEN, pptr);
 
-    inode->validmap = 0;
+    inode->slotmap = 0;
     inode->flipmap = 0;
-    /* MIN_KEY is the sentinel inode's pfence. */
+    /* @lfence is the leader inode's pfence. */
     inode->has_pfence = 1;
     inode->deleted = 0;
 
     inode->next = NULL_ID;
-    inode->pno = sentinel_pnoid;
+    inode->pno = pno;
 
-    inode->rfence = MAX_KEY;
+    inode->rfence = rfence;
 #ifdef INODE_LFENCE
-    inode->lfence = MIN_KEY;
+    inode->lfence = lfence;
 #endif
 
     mcs4_init(&inode->lock);
     seqcount_init(&inode->seq);
 
+    return inode;
+}
+
+int shim_sentinel_init(pnoid_t sentinel_pnoid) {
+    struct shim_layer *s_layer = SHIM(bonsai);
+    inode_t *inode;
+
+    inode = leader_inode_create(sentinel_pnoid, MIN_KEY, MAX_KEY);
+
     s_layer->head = inode;
 
 	printf("sentinel inode: %016lx\n", (unsigned long) inode);
@@ -360,6 +522,160 @@ int shim_sentinel_init(pnoid_t sentinel_pnoid) {
     return 0;
 }
 
+static int rebuild_order_cmp(const void *a, const void *b) {
+    inode_t *x = rebuild_ranges[*(const int *) a].placeholder, *y = rebuild_ranges[*(const int *) b].placeholder;
+    return x < y ? -1 : x > y;
+}
+
+static inline pkey_t rebuild_lfence(const pnoid_t *pnos, const pkey_t *lfences, int i) {
+    return lfences ? lfences[i] : pnode_get_lfence(pnos[i]);
+}
+
+/*
+ * shim_rebuild_init: prepare the lazy rebuild of the shim after restart
+ * @pnos is cut into ranges of REBUILD_RANGE_NR_PNODE pnodes. Each range gets
+ * a placeholder inode now: the leader of its first pnode, but covering the
+ * whole range. The other inodes are built when the range is materialized,
+ * either by a pflush worker in the rebuild stage, or on demand by whoever
+ * hits the placeholder first. The ranges are small, so that a reader never
+ * waits long for one. The fences of the placeholders come from @lfences,
+ * the lfences of @pnos, if known, or from the pnodes otherwise.
+ */
+void shim_rebuild_init(const pnoid_t *pnos, const pkey_t *lfences, int nr) {
+    struct shim_layer *s_layer = SHIM(bonsai);
+    struct rebuild_range *r;
+    inode_t *inode, *prev = NULL;
+    int rid;
+
+    free(rebuild_ranges);
+    free(rebuild_order);
+
+    nr_rebuild_range = (nr + REBUILD_RANGE_NR_PNODE - 1) / REBUILD_RANGE_NR_PNODE;
+    rebuild_ranges = malloc(nr_rebuild_range * sizeof(*rebuild_ranges));
+    rebuild_order = malloc(nr_rebuild_range * sizeof(*rebuild_order));
+
+    for (rid = 0; rid < nr_rebuild_range; rid++) {
+        r = &rebuild_ranges[rid];
+        r->pnos = pnos;
+        r->from = rid * REBUILD_RANGE_NR_PNODE;
+        r->to = min(r->from + REBUILD_RANGE_NR_PNODE, nr);
+        r->done = 0;
+        spin_lock_init(&r->lock);
+
+        inode = leader_inode_create(pnos[r->from], r->from ? rebuild_lfence(pnos, lfences, r->from) : MIN_KEY,
+                                    r->to < nr ? rebuild_lfence(pnos, lfences, r->to) : MAX_KEY);
+        if (prev) {
+            prev->next = inode_ptr2id(inode);
+        } else {
+            s_layer->head = inode;
+        }
+        prev = inode;
+
+        r->placeholder = inode;
+        rebuild_order[rid] = rid;
+    }
+
+    qsort(rebuild_order, nr_rebuild_range, sizeof(*rebuild_order), rebuild_order_cmp);
+
+    smp_wmb();
+    atomic_set(&nr_unmaterialized, nr_rebuild_range);
+
+    bonsai_print("shim_rebuild_init: %d ranges\n", nr_rebuild_range);
+}
+
+/*
+ * Materialize range @r: restore its pnodes, and build one leader inode per
+ * pnode behind the placeholder, which shrinks to its own pnode at last.
+ */
+static void rebuild_range(struct rebuild_range *r) {
+    inode_t *inode, *first = NULL, *prev = NULL, *ph;
+    const pnoid_t *pnos = r->pnos;
+    int i;
+
+    if (ACCESS_ONCE(r->done)) {
+        return;
+    }
+
+    spin_lock(&r->lock);
+    if (r->done) {
+        goto out;
+    }
+
+    for (i = r->from; i < r->to; i++) {
+        pnode_restore(pnos[i], i ? pnos[i - 1] : PNOID_NULL);
+    }
+
+    ph = r->placeholder;
+    for (i = r->from + 1; i < r->to; i++) {
+        inode = leader_inode_create(pnos[i], pnode_get_lfence(pnos[i]), pnode_get_rfence(pnos[i]));
+        if (prev) {
+            prev->next = inode_ptr2id(inode);
+        } else {
+            first = inode;
+        }
+        prev = inode;
+    }
+
+    write_seqcount_begin(&ph->seq);
+    if (first) {
+        prev->next = ph->next;
+        ph->next = inode_ptr2id(first);
+    }
+    ph->rfence = pnode_get_rfence(pnos[r->from]);
+    write_seqcount_end(&ph->seq);
+
+    smp_mb();
+    ACCESS_ONCE(r->done) = 1;
+    atomic_dec(&nr_unmaterialized);
+
+out:
+    spin_unlock(&r->lock);
+}
+
+/*
+ * shim_rebuild_range: materialize the share of pflush worker @wid
+ * Adjacent ranges go to the same worker. Those a reader got to first are
+ * skipped.
+ */
+void shim_rebuild_range(int wid) {
+    int rid, from, to;
+
+    from = (int) ((long) nr_rebuild_range * wid / NUM_PFLUSH_WORKER);
+    to = (int) ((long) nr_rebuild_range * (wid + 1) / NUM_PFLUSH_WORKER);
+
+    for (rid = from; rid < to; rid++) {
+        rebuild_range(&rebuild_ranges[rid]);
+    }
+}
+
+/*
+ * If @inode is a placeholder not materialized yet, materialize its range
+ * alone, and return 1. The caller should look the key up again.
+ */
+static int shim_materialize(inode_t *inode) {
+    int lo = 0, hi = nr_rebuild_range - 1, mid;
+    struct rebuild_range *r;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        r = &rebuild_ranges[rebuild_order[mid]];
+        if (r->placeholder == inode) {
+            if (ACCESS_ONCE(r->done)) {
+                return 0;
+            }
+            rebuild_range(r);
+            return 1;
+        }
+        if (r->placeholder < inode) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return 0;
+}
+
 static inline pkey_t log_get_key(logid_t log) {
     return oplog_get(log)->o_kv.k;
 }
@@ -425,6 +741,7 @@ static void inode_split(inode_t *inode, pkey_t *cut) {
     n->pno = inode->pno;
     n->rfence = inode->rfence;
     n->deleted = 0;
+    n->claimmap = 0;
     mcs4_init(&n->lock);
     seqcount_init(&n->seq);
     memcpy(n->logs, inode->logs, sizeof(inode->logs));
@@ -475,6 +792,12 @@ static void inode_split(inode_t *inode, pkey_t *cut) {
     index_upsert(fence, pptr);
 }
 
+static inline void fgprt_copy(uint8_t *dst, const uint8_t *src) {
+    uint64_t *dst_ = (uint64_t *) dst, *src_ = (uint64_t *) src;
+    dst_[0] = ACCESS_ONCE(src_[0]);
+    dst_[1] = ACCESS_ONCE(src_[1]);
+}
+
 static unsigned inode_find_(logid_t *log, inode_t *inode, pkey_t key, uint8_t *fgprt, uint32_t validmap) {
     __m128i x = _mm_set1_epi8((char) pkey_get_signature(key));
     __m128i y = _mm_load_si128((const __m128i *) fgprt);
@@ -495,36 +818,33 @@ static inline unsigned inode_find(inode_t *inode, pkey_t key) {
 }
 
 /* Insert/update a log key. */
-int shim_upsert(log_state_t *lst, pkey_t key, logid_t log) {
+/*
+ * Upsert @key into the locked *@inode, which covers @key. It may be split,
+ * and then *@inode is set to the locked half covering @key.
+ */
+static int inode_upsert_locked(log_state_t *lst, inode_t **inode, pkey_t key, logid_t log) {
     unsigned long validmap;
-    inode_t *inode;
     unsigned pos;
     int ret;
 
-relookup:
-    inode = inode_seek(key, 0, NULL);
-
-    ret = inode_crab_and_lock(&inode, key, NULL);
-    if (unlikely(ret == -EAGAIN)) {
-        /* The inode has been deleted. */
-        goto relookup;
-    }
-
-    validmap = inode->validmap;
+    validmap = (*inode)->validmap;
 
-    pos = inode_find(inode, key);
+    pos = inode_find(*inode, key);
     if (unlikely(pos != NOT_FOUND)) {
-        /* Key exists, update. */
+        /* Key exists, update, unless a later log of it got here first. */
+        if (unlikely(oplog_get((*inode)->logs[pos])->o_stamp > oplog_get(log)->o_stamp)) {
+            return -EEXIST;
+        }
         ret = -EEXIST;
     } else {
         pos = find_first_zero_bit(&validmap, INODE_FANOUT);
 
         if (unlikely(pos == INODE_FANOUT)) {
             /* Inode full, need to split. */
-            inode_split(inode, NULL);
-            inode_split_unlock_correct(&inode, key);
+            inode_split(*inode, NULL);
+            inode_split_unlock_correct(inode, key);
 
-            validmap = inode->validmap;
+            validmap = (*inode)->validmap;
             pos = find_first_zero_bit(&validmap, INODE_FANOUT);
             assert(pos < INODE_FANOUT);
         }
@@ -534,18 +854,160 @@ relookup:
         ret = 0;
     }
 
-    set_flip(&inode->flipmap, lst, pos);
-    inode->logs[pos] = log;
-	inode->fgprt[pos] = pkey_get_signature(key);
+    set_flip(&(*inode)->flipmap, lst, pos);
+    (*inode)->logs[pos] = log;
+	(*inode)->fgprt[pos] = pkey_get_signature(key);
     barrier();
 
-    inode->validmap = validmap;
+    (*inode)->validmap = validmap;
+
+    return ret;
+}
+
+#ifdef OPTIMISTIC_UPSERT
+
+/*
+ * inode_insert_lockfree: insert a new @key without the inode lock
+ * Claim a free slot in @claimmap, fill it, then turn it valid. The caller
+ * holds the key lock, so nobody else is upserting @key meanwhile. Return
+ * -EAGAIN to take the lock instead: @key exists, the inode is full, or
+ * somebody holds the lock (split, sync, ...). The lock holders wait for
+ * the claims in flight, and the claimers back off once they see the lock.
+ */
+static int inode_insert_lockfree(log_state_t *lst, inode_t *inode, pkey_t key, logid_t log) {
+    uint8_t fgprt[INODE_FANOUT] __attribute__((aligned(16)));
+    uint32_t slotmap, claim;
+    unsigned int seq;
+    unsigned long free;
+    inode_t *next;
+    unsigned pos;
+    logid_t old;
+    pkey_t max;
+
+retry:
+    seq = read_seqcount_begin(&inode->seq);
+
+    max = ACCESS_ONCE(inode->rfence);
+    next = inode_id2ptr(ACCESS_ONCE(inode->next));
+
+    if (unlikely(read_seqcount_retry(&inode->seq, seq))) {
+        goto retry;
+    }
+
+    if (unlikely(pkey_compare(key, max) >= 0)) {
+        inode = next;
+        goto retry;
+    }
+
+    if (unlikely(mcs4_is_locked(&inode->lock) || inode->deleted)) {
+        return -EAGAIN;
+    }
+
+    slotmap = ACCESS_ONCE(inode->slotmap);
+    fgprt_copy(fgprt, inode->fgprt);
+
+    if (inode_find_(&old, inode, key, fgprt, (uint16_t) slotmap) != NOT_FOUND) {
+        /* Update, see @set_flip. */
+        return -EAGAIN;
+    }
+
+    free = ~(slotmap | slotmap >> INODE_FANOUT) & ((1ul << INODE_FANOUT) - 1);
+    if (unlikely(!free)) {
+        /* Full, or about to be. */
+        return -EAGAIN;
+    }
+    pos = __ffs(free);
+    claim = 1u << (pos + INODE_FANOUT);
+
+    /* Fails if the validmap changed since inode_find_. */
+    if (!cmpxchg2(&inode->slotmap, slotmap, slotmap | claim)) {
+        goto retry;
+    }
+
+    /* Deletion takes the lock, and then waits for our claim. */
+    if (unlikely(mcs4_is_locked(&inode->lock) || inode->deleted || read_seqcount_retry(&inode->seq, seq))) {
+        __sync_fetch_and_and(&inode->slotmap, ~claim);
+        return -EAGAIN;
+    }
+
+    inode->logs[pos] = log;
+    inode->fgprt[pos] = pkey_get_signature(key);
+    if (lst->flip) {
+        __sync_fetch_and_or(&inode->flipmap, (uint16_t) (1u << pos));
+    } else {
+        __sync_fetch_and_and(&inode->flipmap, (uint16_t) ~(1u << pos));
+    }
+
+    /* Valid, and no more claimed. */
+    __sync_fetch_and_xor(&inode->slotmap, (1u << pos) | claim);
+
+    return 0;
+}
+
+#endif
+
+int shim_upsert(log_state_t *lst, pkey_t key, logid_t log) {
+    inode_t *inode;
+    int ret;
+
+relookup:
+    inode = inode_seek(key, 0, NULL);
+
+#ifdef OPTIMISTIC_UPSERT
+    if (likely(!inode_insert_lockfree(lst, inode, key, log))) {
+        return 0;
+    }
+#endif
+
+    ret = inode_crab_and_lock(&inode, key, NULL);
+    if (unlikely(ret == -EAGAIN)) {
+        /* The inode has been deleted. */
+        goto relookup;
+    }
+
+    ret = inode_upsert_locked(lst, &inode, key, log);
 
     inode_unlock(inode);
 
+    smo_flush();
+
     return ret;
 }
 
+/*
+ * shim_upsert_batch: upsert @n sorted, distinct keys
+ * Seek once, then crab along the inode chain, so that every inode is
+ * locked once for all the keys falling into it.
+ */
+int shim_upsert_batch(log_state_t *lst, const pentry_t *ents, const logid_t *logs, int n) {
+    inode_t *inode;
+    int i, ret;
+
+    if (unlikely(!n)) {
+        return 0;
+    }
+
+relookup:
+    inode = inode_seek(ents[0].k, 0, NULL);
+
+    ret = inode_crab_and_lock(&inode, ents[0].k, NULL);
+    if (unlikely(ret == -EAGAIN)) {
+        /* The inode has been deleted. */
+        goto relookup;
+    }
+
+    for (i = 0; i < n; i++) {
+        inode_crab(&inode, ents[i].k, NULL);
+        inode_upsert_locked(lst, &inode, ents[i].k, logs[i]);
+    }
+
+    inode_unlock(inode);
+
+    smo_flush();
+
+    return 0;
+}
+
 static int ent_cmp(const void *a, const void *b) {
     const pentry_t *e1 = a, *e2 = b;
     return pkey_compare(e1->k, e2->k);
@@ -564,6 +1026,10 @@ int shim_scan(pkey_t start, int range, pval_t *values) {
     inode = inode_seek(start, 0, NULL);
 
 scan_inode:
+    if (unlikely(atomic_read(&nr_unmaterialized))) {
+        shim_materialize(inode);
+    }
+
     seq = read_seqcount_begin(&inode->seq);
 
     fence = ACCESS_ONCE(inode->rfence);
@@ -671,13 +1137,7 @@ static inline int go_down(pnoid_t pnode, pkey_t key, pval_t *val) {
     return pnode_lookup(pnode, key, val);
 }
 
-static inline void fgprt_copy(uint8_t *dst, const uint8_t *src) {
-    uint64_t *dst_ = (uint64_t *) dst, *src_ = (uint64_t *) src;
-    dst_[0] = ACCESS_ONCE(src_[0]);
-    dst_[1] = ACCESS_ONCE(src_[1]);
-}
-
-int shim_lookup(pkey_t key, pval_t *val) {
+static int do_shim_lookup(pkey_t key, pval_t *val, struct key_version *ver) {
     uint8_t fgprt[INODE_FANOUT];
     inode_t *inode, *next;
     uint32_t validmap;
@@ -713,6 +1173,9 @@ retry:
     if (pos != NOT_FOUND) {
         /* Value in log. */
         *val = log_get_val(log);
+        if (ver) {
+            ver->stamp = oplog_get(log)->o_stamp;
+        }
 
         ret = 0;
         goto done;
@@ -729,12 +1192,40 @@ done:
     }
 
     if (ret == -ENOENT) {
+        if (ver) {
+            /* Any change of the entries from here on bumps the version. */
+            ver->stamp = 0;
+            ver->pno = pnode;
+            ver->pver = pnode_version(pnode);
+            smp_rmb();
+        }
         ret = go_down(pnode, key, val);
+        COUNTER_INC(nr_pnode_hit);
+    } else {
+        if (ver) {
+            ver->pno = PNOID_NULL;
+            ver->pver = 0;
+        }
+        COUNTER_INC(nr_log_hit);
     }
 
     return ret;
 }
 
+int shim_lookup(pkey_t key, pval_t *val) {
+    return do_shim_lookup(key, val, NULL);
+}
+
+/*
+ * shim_lookup_version: look up @key, and tell which version of it was read
+ * The version is the stamp of the log, if @key is in the shim, or the pnode
+ * and its version otherwise. A different version later on means that @key
+ * may have been written since.
+ */
+int shim_lookup_version(pkey_t key, pval_t *val, struct key_version *ver) {
+    return do_shim_lookup(key, val, ver);
+}
+
 pnoid_t shim_pnode_of(pkey_t key) {
     return inode_seek(key, 0, NULL)->pno;
 }
@@ -775,7 +1266,10 @@ static int sync_inode_logs(log_state_t *lst, inode_t *prev, inode_t *inode, stru
          */
         pkey_t old_fence = prev->rfence;
 
+        /* Make the readers and lock-free inserts in @inode retry. */
+        write_seqcount_begin(&inode->seq);
         inode->deleted = 1;
+        write_seqcount_end(&inode->seq);
 
         write_seqcount_begin(&prev->seq);
         prev->next = inode->next;
@@ -929,6 +1423,8 @@ next_pno:
         inode_unlock(inode);
     }
 
+    smo_flush();
+
     return 0;
 }
 
@@ -976,17 +1472,64 @@ void index_layer_init(char* index_name, struct index_layer* layer, init_func_t i
 	layer->scan         = scan;
 	layer->destory      = destroy;
 
+    layer->gc_prepare   = NULL;
+    layer->gc           = NULL;
+    layer->gc_pending   = NULL;
+
     shim_layer_init();
 
 	bonsai_print("index_layer_init: %s\n", index_name);
 }
 
 void index_layer_deinit(struct index_layer* layer) {
+    size_t bytes;
+
+    if (layer->gc) {
+        /* Nobody is reading now. */
+        index_layer_gc(layer);
+        layer->gc(layer->index_struct, layer->gc_prepare(layer->index_struct, &bytes));
+    }
+
 	layer->destory(layer->index_struct);
 
+    free(rebuild_ranges);
+    free(rebuild_order);
+    rebuild_ranges = NULL;
+    rebuild_order = NULL;
+
 	bonsai_print("index_layer_deinit\n");
 }
 
+void index_layer_set_gc(struct index_layer* layer, gc_prepare_func_t prepare, gc_func_t gc) {
+    layer->gc_prepare = prepare;
+    smp_wmb();
+    ACCESS_ONCE(layer->gc) = gc;
+}
+
+/*
+ * index_layer_gc: free the index nodes retired by the last call, and retire
+ * those unlinked since then
+ * The pflush master calls it right after a grace period of the user threads,
+ * see @new_flip, and out of the checkpoint, when no pflush worker is in the
+ * index. So nobody is on the nodes retired by the last call anymore. (The
+ * queues of call_rcu belong to the online user threads, and the master is
+ * none of them.)
+ */
+void index_layer_gc(struct index_layer* layer) {
+    size_t bytes;
+
+    if (!ACCESS_ONCE(layer->gc)) {
+        return;
+    }
+
+    if (layer->gc_pending) {
+        COUNTER_ADD(index_freed, layer->gc(layer->index_struct, layer->gc_pending));
+    }
+
+    layer->gc_pending = layer->gc_prepare(layer->index_struct, &bytes);
+    COUNTER_ADD(index_retired, bytes);
+}
+
 size_t get_inode_size() {
     return sizeof(inode_t);
 }
@@ -7,13 +7,57 @@
 #include <algorithm>
 #include "bonsai.h"
 
+/* Sort a batch of updates by key. The last one wins for duplicated keys. */
+template <typename T, typename GetKey>
+static int sort_dedup(T *ents, int n, GetKey key) {
+    int i, m = 0;
+
+    std::stable_sort(ents, ents + n, [&] (const T &v1, const T &v2) {
+        return pkey_compare(key(v1), key(v2)) < 0;
+    });
+
+    for (i = 0; i < n; i++) {
+        if (m && !pkey_compare(key(ents[m - 1]), key(ents[i]))) {
+            m--;
+        }
+        ents[m++] = ents[i];
+    }
+
+    return m;
+}
+
 extern "C" {
 
 void sort_log_info(struct log_info *logs, int n) {
+#ifndef STR_KEY
+    /* Sort the keys, not the pointers to the oplogs. */
+    struct key_index ki[n];
+    struct log_info sorted[n];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        ki[i].key = *(uint64_t *) logs[i].oplog->o_kv.k.key;
+        ki[i].idx = i;
+    }
+    sort_key_index(ki, n);
+    for (i = 0; i < n; i++) {
+        sorted[i] = logs[ki[i].idx];
+    }
+    std::copy(sorted, sorted + n, logs);
+#else
     /* STL sort is a lot faster than glibc sort... */
     std::sort(logs, logs + n, [] (const struct log_info &v1, const struct log_info &v2) {
         return pkey_compare(v1.oplog->o_kv.k, v2.oplog->o_kv.k) < 0;
     });
+#endif
+}
+
+int sort_batch(pentry_t *ents, int n) {
+    return sort_dedup(ents, n, [] (const pentry_t &e) { return e.k; });
+}
+
+int sort_write_batch(struct batch_ent *ents, int n) {
+    return sort_dedup(ents, n, [] (const struct batch_ent &e) { return e.ent.k; });
 }
 
 }
@@ -10,10 +10,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
-#include <signal.h>
 #include <unistd.h>
 #include <malloc.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include "bonsai.h"
 #include "log_layer.h"
@@ -25,20 +25,42 @@
 #include "data_layer.h"
 #include "index_layer.h"
 #include "rcu.h"
+#include "chkpt.h"
+#include "qos.h"
 
-#define LCB_FULL_SIZE   3072
-//#define LCB_FULL_SIZE	1536
-#define LCB_MAX_SIZE    (LCB_FULL_SIZE * 2)
+/*
+ * Each LCB is written back once it holds its full size of logs, and must
+ * be written back at twice that. The full size adapts between the bounds.
+ */
+#define LCB_FULL_SIZE       3072    /* initial */
+#define LCB_MIN_FULL_SIZE   1536
+#define LCB_MAX_FULL_SIZE   24576
+#define LCB_MAX_SIZE        (LCB_MAX_FULL_SIZE * 2)
+
+#define LCB_FULL_NR         (LCB_FULL_SIZE / sizeof(struct oplog))
+#define LCB_MIN_FULL_NR     (LCB_MIN_FULL_SIZE / sizeof(struct oplog))
+#define LCB_MAX_FULL_NR     (LCB_MAX_FULL_SIZE / sizeof(struct oplog))
+#define LCB_MAX_NR          (LCB_MAX_SIZE / sizeof(struct oplog))
+
+/* Grow the LCB if it's filled this many times between two checkpoints. */
+#define LCB_GROW_FILLS      64
 
-#define LCB_FULL_NR     (LCB_FULL_SIZE / sizeof(struct oplog))
-#define LCB_MAX_NR      (LCB_MAX_SIZE / sizeof(struct oplog))
+/*
+ * Watermarks of a per-CPU log region, in logs. Writers force a checkpoint
+ * above the low one, are slowed down above the high one, and are blocked
+ * at the hard limit, which keeps room for an LCB and the commit logs.
+ */
+#define LOG_LOW_WMARK       (NUM_OPLOG_PER_CPU / 2)
+#define LOG_HIGH_WMARK      (NUM_OPLOG_PER_CPU / 4 * 3)
+#define LOG_HARD_LIMIT      (NUM_OPLOG_PER_CPU - 2 * LCB_MAX_NR)
+
+#define LOG_MAX_THROTTLE    100     /* us, right below the hard limit */
+#define LOG_ADMIT_TIMEOUT   10000   /* us, before giving up at the hard limit */
 
 #define OPLOG_FLIP(t)   ((t) & 1)
 #define OPLOG_TYPE(t)   ((t) & 6)
 #define OPLOG_TXOP(t)     ((t) & 24)
 
-#define WB_SIGNO        SIGUSR1
-
 #define CHECK_NLOG_INTERVAL     20
 
 union logid_u {
@@ -49,8 +71,28 @@ union logid_u {
     };
 };
 
+/*
+ * With ZERO_COPY_FETCH, the fetch stage hands out references to the logs in
+ * the log region instead of copying them out. The referenced logs stay put
+ * until cleanup_stage reclaims them, and admission control keeps writers
+ * from wrapping around onto them in the meantime.
+ */
+#ifdef ZERO_COPY_FETCH
+typedef struct oplog_ref flog_t;
+#define flog_log(f)         ((f)->log)
+#define flog_cmp            oplog_ref_cmp
+#define sort_flogs          sort_oplog_refs
+#define merge_flogs         merge_oplog_refs
+#else
+typedef struct oplog flog_t;
+#define flog_log(f)         (f)
+#define flog_cmp            oplog_cmp
+#define sort_flogs          sort_oplogs
+#define merge_flogs         merge_oplogs
+#endif
+
 typedef struct {
-    struct oplog *logs;
+    flog_t *logs;
     int cnt;
 } logs_t;
 
@@ -94,7 +136,7 @@ struct fetch_workset {
 
 struct sort_contrib {
     int cnt;
-    struct oplog *start;
+    flog_t *start;
 };
 
 struct clustering_workset {
@@ -103,9 +145,9 @@ struct clustering_workset {
 
     pbatch_op_t *pbatch_ops[NUM_PFLUSH_WORKER][NUM_SOCKET];
 
-    struct oplog *local_samples[NUM_PFLUSH_WORKER];
+    flog_t *local_samples[NUM_PFLUSH_WORKER];
     int local_sample_cnt[NUM_PFLUSH_WORKER];
-    struct oplog global_samples[NUM_PFLUSH_WORKER];
+    flog_t global_samples[NUM_PFLUSH_WORKER];
 
     struct sort_contrib sort_contribs[NUM_PFLUSH_WORKER][NUM_PFLUSH_WORKER];
 
@@ -114,7 +156,7 @@ struct clustering_workset {
     /* The output of the clustering work. Loads for each NUMA node. */
     struct flush_load per_socket_loads[NUM_SOCKET];
 
-    pthread_barrier_t barrier;
+    worker_barrier_t barrier;
 };
 
 struct load_balance_workset {
@@ -124,21 +166,31 @@ struct load_balance_workset {
     /* The output of the load balance work. Loads for each worker. */
     struct flush_load per_worker_loads[NUM_PFLUSH_WORKER];
 
-    pthread_barrier_t barrier;
+    worker_barrier_t barrier;
 };
 
 struct flush_workset {
     /* The input of the flush work. Loads for each worker. */
     struct flush_load *per_worker_loads;
+    /* Protect the clusters of each load, which other workers steal from. */
+    spinlock_t load_locks[NUM_PFLUSH_WORKER];
     void *shim_recycle_chains[NUM_PFLUSH_WORKER];
 };
 
+struct chkpt_workset {
+    struct pflush_worksets *worksets;
+    unsigned *since;
+
+    worker_barrier_t barrier;
+};
+
 struct pflush_worksets {
     struct desc_workset         desc_ws;
     struct fetch_workset        fetch_ws;
     struct clustering_workset   clustering_ws;
     struct load_balance_workset load_balance_ws;
     struct flush_workset        flush_ws;
+    struct chkpt_workset        chkpt_ws;
 };
 
 static void check_flush_load(struct flush_load *load) {
@@ -196,6 +248,262 @@ static inline int oplog_overflow_size(struct cpu_log_region_desc *desc, uint32_t
     return (int) (d2 - d1);
 }
 
+static inline struct oplog *cpu_logs(struct cpu_log_region_desc *desc) {
+#ifdef OPLOG_COMPRESSION
+    return desc->mirror;
+#else
+    return desc->region->logs;
+#endif
+}
+
+#ifdef OPLOG_COMPRESSION
+
+/*
+ * Compressed log region: a byte ring of blocks, one per write back. Inside
+ * a block, each log is encoded against the previous one:
+ *
+ *   type (1B) | zigzag varint stamp delta | key | varint value
+ *
+ * A string key is its prefix length shared with the previous key (1B), the
+ * length of the rest with trailing NULs trimmed (1B), and the rest. An
+ * integer key is a zigzag varint delta. An encoded log never exceeds
+ * sizeof(struct oplog).
+ */
+struct oplog_cblk {
+    __le32 nr;      /* logid nr of the first log */
+    __le16 cnt;
+    __le16 size;    /* payload bytes after the header */
+} __packed;
+
+#define OPLOG_RING_SIZE     (NUM_OPLOG_PER_CPU * sizeof(struct oplog))
+
+#define CPOS(boff, nr)      (((uint64_t) (boff) << 32) | (nr))
+#define CPOS_BOFF(pos)      ((uint32_t) ((pos) >> 32))
+#define CPOS_NR(pos)        ((uint32_t) (pos))
+
+#define ZIGZAG(x)           (((uint64_t) (x) << 1) ^ (uint64_t) ((int64_t) (x) >> 63))
+#define UNZIGZAG(x)         (((x) >> 1) ^ -((x) & 1))
+
+static inline unsigned char *put_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char) v;
+    return p;
+}
+
+static inline const unsigned char *get_varint(const unsigned char *p, uint64_t *v) {
+    uint64_t r = 0;
+    int shift = 0;
+
+    while (*p & 0x80) {
+        r |= (uint64_t) (*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *v = r | ((uint64_t) *p++ << shift);
+    return p;
+}
+
+#ifdef STR_KEY
+static inline int key_len(const pkey_t *key) {
+    int len = KEY_LEN;
+    while (len && !key->key[len - 1]) {
+        len--;
+    }
+    return len;
+}
+#endif
+
+static size_t oplog_encode(unsigned char *buf, const struct oplog *logs, size_t n) {
+    pentry_t prev = { .k = MIN_KEY };
+    unsigned char *p = buf;
+    __le64 stamp = 0;
+#ifdef STR_KEY
+    int len, prev_len = 0, shared;
+#else
+    uint64_t key;
+#endif
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        *p++ = (unsigned char) logs[i].o_type;
+        p = put_varint(p, ZIGZAG(logs[i].o_stamp - stamp));
+        stamp = logs[i].o_stamp;
+
+#ifdef STR_KEY
+        len = key_len(&logs[i].o_kv.k);
+        for (shared = 0; shared < min(len, prev_len); shared++) {
+            if (logs[i].o_kv.k.key[shared] != prev.k.key[shared]) {
+                break;
+            }
+        }
+        *p++ = (unsigned char) shared;
+        *p++ = (unsigned char) (len - shared);
+        memcpy(p, &logs[i].o_kv.k.key[shared], len - shared);
+        p += len - shared;
+        prev_len = len;
+#else
+        key = *(uint64_t *) logs[i].o_kv.k.key;
+        p = put_varint(p, ZIGZAG(key - *(uint64_t *) prev.k.key));
+#endif
+        p = put_varint(p, logs[i].o_kv.v);
+
+        prev = logs[i].o_kv;
+    }
+
+    return p - buf;
+}
+
+static void oplog_decode(struct oplog *logs, const unsigned char *buf, size_t n) {
+    const unsigned char *p = buf;
+    pentry_t prev = { .k = MIN_KEY };
+    __le64 stamp = 0;
+    uint64_t v;
+#ifdef STR_KEY
+    int shared, rest;
+#endif
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        logs[i].o_type = *p++;
+        p = get_varint(p, &v);
+        logs[i].o_stamp = stamp += UNZIGZAG(v);
+
+#ifdef STR_KEY
+        shared = *p++;
+        rest = *p++;
+        memset(&logs[i].o_kv.k, 0, sizeof(pkey_t));
+        memcpy(logs[i].o_kv.k.key, prev.k.key, shared);
+        memcpy(&logs[i].o_kv.k.key[shared], p, rest);
+        p += rest;
+#else
+        p = get_varint(p, &v);
+        *(uint64_t *) logs[i].o_kv.k.key = *(uint64_t *) prev.k.key + UNZIGZAG(v);
+#endif
+        p = get_varint(p, &v);
+        logs[i].o_kv.v = v;
+
+        prev = logs[i].o_kv;
+    }
+}
+
+static uint32_t ring_write(char *ring, uint32_t off, const void *src, size_t len) {
+    size_t c = min(OPLOG_RING_SIZE - off, len);
+
+    memcpy_nt(ring + off, (void *) src, c, 0);
+    if (len > c) {
+        memcpy_nt(ring, (char *) src + c, len - c, 0);
+    }
+    return (off + len) % OPLOG_RING_SIZE;
+}
+
+static uint32_t ring_read(void *dst, const char *ring, uint32_t off, size_t len) {
+    size_t c = min(OPLOG_RING_SIZE - off, len);
+
+    memcpy(dst, ring + off, c);
+    if (len > c) {
+        memcpy((char *) dst + c, ring, len - c);
+    }
+    return (off + len) % OPLOG_RING_SIZE;
+}
+
+/*
+ * Append @len logs of @lcb to the compressed region and the DRAM mirror of
+ * @desc. Return the new byte end of the region.
+ */
+static uint32_t compress_logs(struct cpu_log_region_desc *desc, struct oplog *lcb, size_t len) {
+    unsigned char buf[sizeof(struct oplog_cblk) + LCB_MAX_SIZE];
+    struct oplog_cblk *blk = (struct oplog_cblk *) buf;
+    uint32_t end = desc->end;
+    size_t i;
+
+    if (!len) {
+        return desc->bend;
+    }
+
+    blk->nr = cpu_to_le32(end);
+    blk->cnt = cpu_to_le16(len);
+    blk->size = cpu_to_le16(oplog_encode(buf + sizeof(*blk), lcb, len));
+
+    for (i = 0; i < len; i++) {
+        desc->mirror[end] = lcb[i];
+        desc->cblk[end] = desc->bend;
+        end = (end + 1) % NUM_OPLOG_PER_CPU;
+    }
+
+    return ring_write((char *) desc->region->logs, desc->bend, buf, sizeof(*blk) + blk->size);
+}
+
+/* Rebuild the DRAM mirror of @desc from the compressed region of the last run. */
+static void decompress_logs(struct cpu_log_region_desc *desc) {
+    const char *ring = (const char *) desc->region->logs;
+    uint64_t start = desc->region->meta.start, end = desc->region->meta.end;
+    unsigned char buf[LCB_MAX_SIZE];
+    struct oplog logs[LCB_MAX_NR];
+    struct oplog_cblk blk;
+    uint32_t boff, next, nr;
+    int i;
+
+    for (boff = CPOS_BOFF(start); boff != CPOS_BOFF(end); boff = next) {
+        next = ring_read(&blk, ring, boff, sizeof(blk));
+        next = ring_read(buf, ring, next, blk.size);
+
+        oplog_decode(logs, buf, blk.cnt);
+        for (i = 0, nr = blk.nr; i < blk.cnt; i++, nr = (nr + 1) % NUM_OPLOG_PER_CPU) {
+            desc->mirror[nr] = logs[i];
+            desc->cblk[nr] = boff;
+        }
+    }
+
+    desc->start = CPOS_NR(start);
+    desc->end = CPOS_NR(end);
+    desc->bstart = CPOS_BOFF(start);
+    desc->bend = CPOS_BOFF(end);
+}
+
+static void *mirror_alloc(size_t size) {
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (unlikely(addr == MAP_FAILED)) {
+        perror("mmap");
+        abort();
+    }
+    return addr;
+}
+
+static void reclaim_range(void *base, size_t unit, uint32_t from, uint32_t to) {
+    unsigned long s, e;
+
+    if (from > to) {
+        reclaim_range(base, unit, from, NUM_OPLOG_PER_CPU);
+        from = 0;
+    }
+
+    s = ALIGN((unsigned long) base + from * unit, PAGE_SIZE);
+    e = ALIGN_DOWN((unsigned long) base + to * unit, PAGE_SIZE);
+    if (s < e) {
+        madvise((void *) s, e - s, MADV_DONTNEED);
+    }
+}
+
+/*
+ * Give back the mirror pages of the logs consumed by the last checkpoint.
+ * Called after @new_flip, so nobody reads them through @oplog_get now.
+ */
+static void reclaim_mirror() {
+    struct cpu_log_region_desc *desc;
+    int cpu;
+
+    for (cpu = 0; cpu < NUM_CPU; cpu++) {
+        desc = &LOG(bonsai)->desc->descs[cpu];
+        reclaim_range(desc->mirror, sizeof(struct oplog), desc->reclaim_from, desc->reclaim_to);
+        reclaim_range(desc->cblk, sizeof(uint32_t), desc->reclaim_from, desc->reclaim_to);
+        desc->reclaim_from = desc->reclaim_to;
+    }
+}
+
+#endif
+
 void oplog_snapshot_lst(log_state_t *lst) {
     *lst = LOG(bonsai)->lst;
 }
@@ -218,131 +526,438 @@ struct oplog *oplog_get(logid_t logid) {
         if (unlikely(overflow >= 0)) {
             oplog = &desc->lcb[overflow];
         } else {
-            oplog = &desc->region->logs[id.nr];
+            oplog = &cpu_logs(desc)[id.nr];
         }
     } while (read_seqcount_retry(&desc->seq, seq));
 
     return oplog;
 }
 
-static void write_back(int cpu, int dimm_unlock, void *wb_new_buf_in_signal) {
+/* Why an LCB is written back */
+enum {
+    WB_FULL,    /* it's full */
+    WB_CHKPT,   /* asked by a checkpoint */
+    WB_SYNC     /* asked by the owner, see @oplog_sync */
+};
+
+/*
+ * Resize the next LCB of @desc. Heavy writers, which fill it often or find
+ * the DIMM busy, get larger bursts. Idle ones, which only get written back
+ * by checkpoints, give the DRAM back. Syncs say nothing about the rate.
+ */
+static void lcb_adapt(struct cpu_log_region_desc *desc, int why) {
+    size_t full = desc->lcb_full_nr;
+
+    if (why == WB_SYNC) {
+        desc->lcb_stat.nr_sync_wb++;
+        return;
+    }
+
+    if (why == WB_CHKPT) {
+        desc->lcb_stat.nr_forced_wb++;
+        if (desc->lcb_fills >= LCB_GROW_FILLS) {
+            full *= 2;
+        } else if (!desc->lcb_fills && desc->lcb_size < full / 4) {
+            full /= 2;
+        }
+        desc->lcb_fills = 0;
+    } else {
+        desc->lcb_stat.nr_wb++;
+        desc->lcb_fills++;
+        if (desc->lcb_contended) {
+            full *= 2;
+        }
+    }
+    desc->lcb_contended = 0;
+
+    full = clamp(full, LCB_MIN_FULL_NR, LCB_MAX_FULL_NR);
+    if (full > desc->lcb_full_nr) {
+        desc->lcb_stat.nr_grow++;
+    } else if (full < desc->lcb_full_nr) {
+        desc->lcb_stat.nr_shrink++;
+    }
+
+    desc->lcb_full_nr = full;
+    desc->lcb_max_nr = full * 2;
+}
+
+/*
+ * Write back the LCB of @cpu, and switch to a new one. Return the old LCB,
+ * which may still be read by others through @oplog_get. @why is one of
+ * WB_*.
+ */
+static struct oplog *write_back(int cpu, int dimm_unlock, int why) {
 	struct log_layer* layer = LOG(bonsai);
     struct cpu_log_region_desc *local_desc = &layer->desc->descs[cpu];
     struct cpu_log_region *region = local_desc->region;
     uint32_t end = local_desc->end;
-    struct oplog *lcb;
-    size_t len, c;
+    struct oplog *lcb, *old_lcb;
+    size_t len, len_all, c;
+#ifdef OPLOG_COMPRESSION
+    uint32_t bend;
+#endif
 
-    lcb = local_desc->lcb;
-    len = local_desc->lcb_size;
+    old_lcb = lcb = local_desc->lcb;
+    len_all = len = local_desc->lcb_size;
 
     /* Make sure value allocations are persistent. */
     valman_persist_alloca_cpu(cpu);
 
+#ifdef OPLOG_COMPRESSION
+    bend = compress_logs(local_desc, lcb, len);
+    end = (end + len) % NUM_OPLOG_PER_CPU;
+    (void) c;
+#else
     while ((c = min(NUM_OPLOG_PER_CPU - end, len))) {
         memcpy_nt(&region->logs[end], lcb, c * sizeof(struct oplog), 0);
         end  = (end + c) % NUM_OPLOG_PER_CPU;
         len -= c;
         lcb += c;
     }
+#endif
     memory_sfence();
 
     if (dimm_unlock) {
         pthread_mutex_unlock(local_desc->dimm_lock);
     }
 
-    if (!wb_new_buf_in_signal) {
-        /* Not in signal. */
-        lcb = malloc(LCB_MAX_SIZE * sizeof(*lcb));
-        call_rcu(RCU(bonsai), free, local_desc->lcb);
-    } else {
-        lcb = wb_new_buf_in_signal;
-        /* TODO: Delay-free local_desc->lcb (@call_rcu is non-reentrant, so we can not use it here.) */
-    }
+    lcb_adapt(local_desc, why);
+    lcb = malloc(local_desc->lcb_max_nr * sizeof(*lcb));
 
     local_desc->lcb_size = 0;
 
     /* durable point */
+#ifdef OPLOG_COMPRESSION
+    region->meta.end = CPOS(bend, end);
+#else
     region->meta.end = end;
-    bonsai_flush(&region->meta.end, sizeof(__le32), 1);
+#endif
+    bonsai_flush(&region->meta.end, sizeof(region->meta.end), 1);
+    ACCESS_ONCE(local_desc->durable_lsn) += len_all;
 
     /* linearizable point */
     write_seqcount_begin(&local_desc->seq);
     local_desc->end = end;
+#ifdef OPLOG_COMPRESSION
+    local_desc->bend = bend;
+#endif
     local_desc->lcb = lcb;
     write_seqcount_end(&local_desc->seq);
+
+    return old_lcb;
 }
 
-static void handle_wb(int signo) {
-    int cpu = __this->t_cpu;
+/* Write back the local LCB, by the owner thread. */
+static inline void write_back_local(int cpu, int dimm_unlock, int why) {
+    call_rcu(RCU(bonsai), free, write_back(cpu, dimm_unlock, why));
+}
+
+/* Enter the LCB of @cpu. Wait if the master is writing it back for us. */
+static inline void oplog_insert_begin(struct cpu_log_region_desc *local_desc) {
+    while (unlikely(cmpxchg(&local_desc->wb_state, WBS_ENABLE, WBS_DELAY) != WBS_ENABLE)) {
+        cpu_relax();
+    }
+}
+
+/*
+ * Called after appending @nr logs to the LCB of @cpu: write back if it's
+ * full, serve the delayed write back request, and account the logs.
+ */
+static void oplog_insert_done(int cpu, int nr) {
 	struct log_layer *layer = LOG(bonsai);
     struct cpu_log_region_desc *local_desc = &layer->desc->descs[cpu];
+    static __thread int last = 0;
 
-    switch (local_desc->wb_state) {
-        case WBS_ENABLE:
-            write_back(cpu, 0, local_desc->wb_new_buf);
-            local_desc->wb_done = 1;
-            break;
+    if (unlikely(local_desc->lcb_size >= local_desc->lcb_full_nr
+			&& (nr > 1 || local_desc->lcb_size % 4 == 0))) {
+        if (!pthread_mutex_trylock(local_desc->dimm_lock)) {
+            write_back_local(cpu, 1, WB_FULL);
+        } else {
+            local_desc->lcb_stat.nr_contended++;
+            local_desc->lcb_contended = 1;
+            if (unlikely(local_desc->lcb_size >= local_desc->lcb_max_nr)) {
+                write_back_local(cpu, 0, WB_FULL);
+            }
+        }
+    }
 
-        case WBS_DELAY:
-            local_desc->wb_state = WBS_REQUEST;
-            break;
+    /* The master asked for a write back while we're appending. */
+    if (cmpxchg(&local_desc->wb_state, WBS_DELAY, WBS_ENABLE) == WBS_REQUEST) {
+        write_back_local(cpu, 0, WB_CHKPT);
+        local_desc->wb_state = WBS_ENABLE;
+        ACCESS_ONCE(local_desc->wb_done) = 1;
+        futex_wake(&local_desc->wb_done);
+    }
 
-        default:
-            assert(0);
+#ifndef DISABLE_OFFLOAD
+    if ((last += nr) >= CHECK_NLOG_INTERVAL) {
+        if (atomic_add_return(last, &layer->nlogs[cpu].cnt) >= ACCESS_ONCE(chkpt_trigger_nlog) / NUM_CPU &&
+            !atomic_read(&layer->checkpoint)) {
+#ifdef ENABLE_AUTO_CHKPT
+            wakeup_master();
+#endif
+        }
+        last = 0;
     }
+#endif
 }
 
-logid_t oplog_insert(log_state_t *lst, pkey_t key, pval_t val, optype_t op, txop_t txop, int cpu) {
-	struct log_layer *layer = LOG(bonsai);
-    struct cpu_log_region_desc *local_desc = &layer->desc->descs[cpu];
+/* Append a log to the LCB of @cpu, entered with room for it. */
+static logid_t oplog_append(log_state_t *lst, pkey_t key, pval_t val, optype_t op, txop_t txop, int cpu) {
+    struct cpu_log_region_desc *local_desc = &LOG(bonsai)->desc->descs[cpu];
     uint32_t end = local_desc->end;
-    static __thread int last = 0;
 	struct oplog* log;
     union logid_u id;
 
-    local_desc->wb_state = WBS_DELAY;
-    barrier();
-
-    assert(local_desc->lcb_size < LCB_MAX_NR);
+    assert(local_desc->lcb_size < local_desc->lcb_max_nr);
 
     id.cpu = cpu;
     id.nr = (local_desc->lcb_size + end) % NUM_OPLOG_PER_CPU;
 
     log = &local_desc->lcb[local_desc->lcb_size++];
+    local_desc->lsn++;
 	log->o_type = cpu_to_le64(txop | op | lst->flip);
     log->o_stamp = cpu_to_le64(ordo_new_clock(0));
 	log->o_kv.k = key;
 	log->o_kv.v = val;
 
-    if (unlikely(local_desc->lcb_size >= LCB_FULL_NR
-			&& local_desc->lcb_size % 4 == 0)) {
-        if (!pthread_mutex_trylock(local_desc->dimm_lock)) {
-            write_back(cpu, 1, NULL);
-        } else if (unlikely(local_desc->lcb_size >= LCB_MAX_NR)) {
-            write_back(cpu, 0, NULL);
+    return id.id;
+}
+
+logid_t oplog_insert(log_state_t *lst, pkey_t key, pval_t val, optype_t op, txop_t txop, int cpu) {
+    logid_t id;
+
+    oplog_insert_begin(&LOG(bonsai)->desc->descs[cpu]);
+    id = oplog_append(lst, key, val, op, txop, cpu);
+    oplog_insert_done(cpu, 1);
+
+    return id;
+}
+
+/*
+ * oplog_reserve: enter the LCB of @cpu with room for one more log
+ * The log is appended by @oplog_insert_reserved, and the LCB is left by
+ * @oplog_reserve_done, which runs the write backs due meanwhile. Nothing
+ * in between writes back to NVM or waits for the master, which waits for
+ * us instead, so the caller may hold locks that other writers spin on.
+ */
+void oplog_reserve(int cpu) {
+    struct cpu_log_region_desc *local_desc = &LOG(bonsai)->desc->descs[cpu];
+
+    oplog_insert_begin(local_desc);
+
+    if (unlikely(local_desc->lcb_size >= local_desc->lcb_max_nr)) {
+        write_back_local(cpu, 0, WB_FULL);
+    }
+}
+
+logid_t oplog_insert_reserved(log_state_t *lst, pkey_t key, pval_t val, optype_t op, txop_t txop, int cpu) {
+    return oplog_append(lst, key, val, op, txop, cpu);
+}
+
+void oplog_reserve_done(int cpu) {
+    oplog_insert_done(cpu, 1);
+}
+
+/*
+ * oplog_insert_batch: append @n logs of distinct keys in one go
+ * They share one timestamp, as the order only matters for the same key.
+ * All of them but the last one are TX_OP, so the batch is atomic if @txop
+ * is TX_COMMIT. @ops gives the type of each log, or NULL for @op for all.
+ * The logids are returned in @ids.
+ */
+void oplog_insert_batch(log_state_t *lst, const pentry_t *ents, const optype_t *ops, int n, optype_t op,
+                        txop_t txop, int cpu, logid_t *ids) {
+	struct log_layer *layer = LOG(bonsai);
+    struct cpu_log_region_desc *local_desc = &layer->desc->descs[cpu];
+    __le64 stamp = cpu_to_le64(ordo_new_clock(0));
+	struct oplog* log;
+    union logid_u id;
+    int i;
+
+    oplog_insert_begin(local_desc);
+
+    id.cpu = cpu;
+    for (i = 0; i < n; i++) {
+        if (unlikely(local_desc->lcb_size >= local_desc->lcb_max_nr)) {
+            write_back_local(cpu, 0, WB_FULL);
         }
+
+        id.nr = (local_desc->lcb_size + local_desc->end) % NUM_OPLOG_PER_CPU;
+        ids[i] = id.id;
+
+        log = &local_desc->lcb[local_desc->lcb_size++];
+        local_desc->lsn++;
+        log->o_type = cpu_to_le64((i == n - 1 ? txop : TX_OP) | (ops ? ops[i] : op) | lst->flip);
+        log->o_stamp = stamp;
+        log->o_kv = ents[i];
     }
 
-    if (cmpxchg_local(&local_desc->wb_state, WBS_DELAY, WBS_ENABLE) == WBS_REQUEST) {
-        write_back(cpu, 0, NULL);
-        local_desc->wb_state = WBS_ENABLE;
-        local_desc->wb_done = 1;
+    oplog_insert_done(cpu, n);
+}
+
+/* The logs appended to @cpu in this run, which is the LSN of the last one. */
+uint64_t oplog_lsn(int cpu) {
+    return LOG(bonsai)->desc->descs[cpu].lsn;
+}
+
+/*
+ * oplog_sync: make the logs of @cpu up to @lsn durable, by its owner
+ * Write back the LCB now, rather than when it's full or at the next
+ * checkpoint. Nothing to do if it's already done, by us or by the master.
+ */
+void oplog_sync(int cpu, uint64_t lsn) {
+    struct cpu_log_region_desc *local_desc = &LOG(bonsai)->desc->descs[cpu];
+
+    if (ACCESS_ONCE(local_desc->durable_lsn) >= lsn) {
+        return;
     }
 
-#ifndef DISABLE_OFFLOAD
-    if (++last == CHECK_NLOG_INTERVAL) {
-        if (atomic_add_return(CHECK_NLOG_INTERVAL, &layer->nlogs[cpu].cnt) >= CHKPT_NLOG_INTERVAL / NUM_CPU &&
-            !atomic_read(&layer->checkpoint)) {
-#ifdef ENABLE_AUTO_CHKPT
-            wakeup_master();
-#endif
+    /* Keep the master from stealing the LCB, or wait till it's done. */
+    oplog_insert_begin(local_desc);
+
+    if (local_desc->durable_lsn < lsn) {
+        write_back_local(cpu, 0, WB_SYNC);
+    }
+
+    oplog_insert_done(cpu, 0);
+}
+
+void oplog_lcb_stat(int cpu, struct lcb_stat *stat, size_t *lcb_full_nr) {
+    struct cpu_log_region_desc *desc = &LOG(bonsai)->desc->descs[cpu];
+
+    *stat = desc->lcb_stat;
+    *lcb_full_nr = ACCESS_ONCE(desc->lcb_full_nr);
+}
+
+/* Return if @cpu is being throttled now. */
+int oplog_admit_stat(int cpu, struct admit_stat *stat) {
+    struct cpu_log_region_desc *desc = &LOG(bonsai)->desc->descs[cpu];
+
+    *stat = desc->admit_stat;
+    return ACCESS_ONCE(desc->throttling);
+}
+
+void oplog_dump_stat() {
+    struct admit_stat astat;
+    struct lcb_stat stat;
+    size_t full_nr;
+    int cpu, throttling;
+
+    for (cpu = 0; cpu < NUM_CPU; cpu++) {
+        oplog_lcb_stat(cpu, &stat, &full_nr);
+        if (stat.nr_wb || stat.nr_forced_wb || stat.nr_sync_wb) {
+            bonsai_print("cpu[%d] lcb: full %lu logs, %lu write backs, %lu forced, %lu synced, %lu contended, "
+                         "%lu grows, %lu shrinks\n", cpu, full_nr, stat.nr_wb, stat.nr_forced_wb, stat.nr_sync_wb,
+                         stat.nr_contended, stat.nr_grow, stat.nr_shrink);
+        }
+
+        throttling = oplog_admit_stat(cpu, &astat);
+        if (throttling || astat.nr_forced_chkpt) {
+            bonsai_print("cpu[%d] admit: %s, %lu forced checkpoints, %lu throttled, %lu blocked, %lu rejected, %lu us\n",
+                         cpu, throttling ? "throttling" : "open", astat.nr_forced_chkpt, astat.nr_throttled,
+                         astat.nr_blocked, astat.nr_rejected, astat.throttle_us);
         }
-        last = 0;
     }
+}
+
+/* The room @desc would take with @n more logs, in logs */
+static inline size_t oplog_region_used(struct cpu_log_region_desc *desc, int n) {
+    size_t used = (desc->end - desc->start + NUM_OPLOG_PER_CPU) % NUM_OPLOG_PER_CPU + desc->lcb_size + n;
+#ifdef OPLOG_COMPRESSION
+    /*
+     * The blocks may take more than a log each: a small write back barely
+     * compresses, and pays a block header. Count the blocks by bytes, and
+     * the logs yet to be written back at their worst, a block each.
+     */
+    size_t bytes = (desc->bend - desc->bstart + OPLOG_RING_SIZE) % OPLOG_RING_SIZE +
+                   (desc->lcb_size + n) * (sizeof(struct oplog) + sizeof(struct oplog_cblk));
+    used = max(used, (bytes + sizeof(struct oplog) - 1) / sizeof(struct oplog));
 #endif
+    return used;
+}
 
-    return id.id;
+/* The most logs one call can take: those alone fill up to the hard limit. */
+static inline int oplog_admit_max(void) {
+#ifdef OPLOG_COMPRESSION
+    return (LOG_HARD_LIMIT - 1) * sizeof(struct oplog) / (sizeof(struct oplog) + sizeof(struct oplog_cblk));
+#else
+    return LOG_HARD_LIMIT - 1;
+#endif
+}
+
+/*
+ * oplog_admit: admission control before appending @n logs to @cpu
+ * Past the low watermark, force a checkpoint. Past the high watermark,
+ * sleep longer as the region fills up. At the hard limit, wait up to
+ * LOG_ADMIT_TIMEOUT for a checkpoint to free some room, or give up with
+ * -EAGAIN. A caller inside a durable transaction can't pass a quiescent
+ * state, so it's never slowed down, and is refused at the hard limit
+ * right away (@can_wait = 0). With OPLOG_COMPRESSION, the region is full
+ * by bytes as well, and the hard limit keeps the byte ring from wrapping
+ * over the blocks not checkpointed yet. More logs than an empty region
+ * can take (oplog_admit_max) never get in: return -E2BIG for them.
+ */
+int oplog_admit(int cpu, int n, int can_wait) {
+	struct log_layer *layer = LOG(bonsai);
+    struct cpu_log_region_desc *desc = &layer->desc->descs[cpu];
+    struct admit_stat *stat = &desc->admit_stat;
+    long delay, waited = 0;
+    size_t used;
+
+    if (unlikely(n > oplog_admit_max())) {
+        stat->nr_rejected++;
+        return -E2BIG;
+    }
+
+    for (;;) {
+        used = oplog_region_used(desc, n);
+
+        if (likely(used < LOG_LOW_WMARK)) {
+            desc->throttling = 0;
+            return 0;
+        }
+
+        if (!atomic_read(&layer->force_flush)) {
+            atomic_set(&layer->force_flush, 1);
+            stat->nr_forced_chkpt++;
+        }
+        wakeup_master();
+
+        if (used < LOG_HIGH_WMARK || (!can_wait && used < LOG_HARD_LIMIT)) {
+            desc->throttling = 0;
+            return 0;
+        }
+
+        if (!can_wait) {
+            stat->nr_rejected++;
+            return -EAGAIN;
+        }
+
+        desc->throttling = 1;
+
+        /* Don't hold the checkpoint back while we're waiting for it. */
+        rcu_quiescent(RCU(bonsai));
+
+        if (used < LOG_HARD_LIMIT) {
+            delay = (long) ((used - LOG_HIGH_WMARK) * LOG_MAX_THROTTLE / (LOG_HARD_LIMIT - LOG_HIGH_WMARK)) + 1;
+            stat->nr_throttled++;
+            stat->throttle_us += delay;
+            usleep(delay);
+            return 0;
+        }
+
+        if (waited >= LOG_ADMIT_TIMEOUT) {
+            stat->nr_rejected++;
+            return -EAGAIN;
+        }
+        if (!waited) {
+            stat->nr_blocked++;
+        }
+        usleep(100);
+        waited += 100;
+        stat->throttle_us += 100;
+    }
 }
 
 static inline int worker_id(int numa_node, int nr) {
@@ -375,55 +990,60 @@ static inline void new_flip() {
 }
 
 static void launch_workers(struct pflush_worksets *worksets, work_func_t fn, void *workset) {
-    struct work_struct *work;
     struct pflush_work_desc *desc;
     int wid;
 
     for (wid = 0; wid < NUM_PFLUSH_WORKER; wid++) {
         desc = &worksets->desc_ws.desc[wid];
         desc->workset = workset;
-
-        work = malloc(sizeof(struct work_struct));
-        INIT_LIST_HEAD(&work->list);
-        work->exec = fn;
-        work->exec_arg = desc;
-        workqueue_add(&bonsai->pflush_workers[worker_numa_node(wid)][worker_nr(wid)]->t_wq, work);
+        queue_work(worker_thread_info(wid), fn, desc);
     }
 
-	wakeup_workers();
-	park_master();
+    wait_works();
 }
 
 static size_t log_nr(struct cpu_log_snapshot *snap) {
     return (snap->region_end - snap->region_start + NUM_OPLOG_PER_CPU) % NUM_OPLOG_PER_CPU;
 }
 
+/*
+ * Write back the LCBs of all the user threads. Those out of @oplog_insert
+ * are written back by us. Those inside are asked to do it on their way out,
+ * and we wait for them.
+ */
 static void force_wb() {
 	struct log_layer *layer = LOG(bonsai);
     struct cpu_log_region_desc *desc;
     struct thread_info *ti;
-    int i, ret = 0;
+    int i, state;
 
 	for (i = 0; i < NUM_USER_THREAD; i++) {
 		ti = bonsai->user_threads[i];
-
 		desc = &layer->desc->descs[ti->t_cpu];
+
+        /* Nobody reads the LCB written back last time now, see @new_flip. */
+        free(desc->stale_lcb);
+        desc->stale_lcb = NULL;
+
 		desc->wb_done = 0;
-        desc->wb_new_buf = malloc(LCB_MAX_SIZE * sizeof(struct oplog));
 
-		ret = pthread_kill(bonsai->tids[ti->t_id], WB_SIGNO);
-		if (unlikely(ret)) {
-            assert(0);
-        }
+        do {
+            state = cmpxchg(&desc->wb_state, WBS_ENABLE, WBS_STEAL);
+            if (state == WBS_ENABLE) {
+                desc->stale_lcb = write_back(ti->t_cpu, 0, WB_CHKPT);
+                ACCESS_ONCE(desc->wb_state) = WBS_ENABLE;
+                desc->wb_done = 1;
+                break;
+            }
+        } while (cmpxchg(&desc->wb_state, WBS_DELAY, WBS_REQUEST) != WBS_DELAY);
 	}
 
     for (i = 0; i < NUM_USER_THREAD; i++) {
         ti = bonsai->user_threads[i];
-
         desc = &layer->desc->descs[ti->t_cpu];
 
         while (!ACCESS_ONCE(desc->wb_done)) {
-            usleep(1000);
+            futex_wait(&desc->wb_done, 0);
         }
     }
 }
@@ -437,12 +1057,22 @@ static void snapshot_cpu_log(struct cpu_log_snapshot *snap, int cpu) {
     snap->region_end = local_desc->end;
 }
 
+static inline void flog_fill(flog_t *f, struct oplog *plog) {
+#ifdef ZERO_COPY_FETCH
+    f->kprefix = pkey_prefix(plog->o_kv.k);
+    f->stamp = plog->o_stamp;
+    f->log = plog;
+#else
+    memcpy(f, plog, sizeof(*f));
+#endif
+}
+
 static size_t fetch_cpu_logs(size_t *nr_logs_processed, uint32_t *new_region_starts,
-                             struct oplog *logs, struct cpu_log_snapshot *snap) {
+                             flog_t *logs, struct cpu_log_snapshot *snap) {
 	struct log_layer *layer = LOG(bonsai);
     struct cpu_log_region_desc *local_desc = &layer->desc->descs[snap->cpu];
-    struct cpu_log_region *region = local_desc->region;
-    struct oplog *plog, *log, *last_commit = logs;
+    flog_t *log, *last_commit = logs;
+    struct oplog *plog;
     int target_flip = !layer->lst.flip;
     uint32_t cur, end;
 
@@ -452,15 +1082,22 @@ static size_t fetch_cpu_logs(size_t *nr_logs_processed, uint32_t *new_region_sta
     *nr_logs_processed = 0;
 
     for (log = logs; cur != end; cur = (cur + 1) % NUM_OPLOG_PER_CPU, (*nr_logs_processed)++) {
-        plog = &region->logs[cur];
-		if (unlikely((int) OPLOG_FLIP(plog->o_type) != target_flip)) {
+        plog = &cpu_logs(local_desc)[cur];
+        /* Logs left by the last run may come from both flips. Take them all. */
+		if (unlikely((int) OPLOG_FLIP(plog->o_type) != target_flip && !layer->recovery)) {
             break;
         }
         if (OPLOG_TYPE(plog->o_type) != OP_NOP) {
-            memcpy(log++, plog, sizeof(*log));
+            flog_fill(log++, plog);
         }
-        if (OPLOG_TXOP(plog->o_type) == TX_COMMIT) {
-            last_commit = log;
+        switch (OPLOG_TXOP(plog->o_type)) {
+            case TX_COMMIT:
+                last_commit = log;
+                break;
+            case TX_ROLLBACK:
+                /* Drop the whole aborted transaction. */
+                log = last_commit;
+                break;
         }
     }
 
@@ -476,8 +1113,8 @@ static logs_t fetch_logs(uint32_t *new_region_starts, int nr_cpu, int *cpus) {
     size_t nr_logs_fetched, nr_logs_processed;
     struct log_layer *layer = LOG(bonsai);
     int tot_max = 0, nr_logs_max, i;
-    struct oplog *log;
     logs_t fetched;
+    flog_t *log;
 
     for (i = 0; i < nr_cpu; i++) {
         snapshot_cpu_log(&snapshots[i], cpus[i]);
@@ -550,20 +1187,20 @@ static int fetch_work(void *arg) {
     return 0;
 }
 
-static int lower_bound(struct oplog haystack[], int nr, struct oplog *needle) {
+static int lower_bound(flog_t haystack[], int nr, flog_t *needle) {
     int mid, l = 0, r = nr;
 
     while (l < r) {
         mid = l + (r - l) / 2;
 
-        if (oplog_cmp(needle, &haystack[mid]) <= 0) {
+        if (flog_cmp(needle, &haystack[mid]) <= 0) {
             r = mid;
         } else {
             l = mid + 1;
         }
     }
 
-    if (l < nr && oplog_cmp(&haystack[l], needle) < 0) {
+    if (l < nr && flog_cmp(&haystack[l], needle) < 0) {
         l++;
     }
 
@@ -571,29 +1208,38 @@ static int lower_bound(struct oplog haystack[], int nr, struct oplog *needle) {
 }
 
 void sort_oplogs(struct oplog *oplogs, int nr);
+size_t merge_oplogs(struct oplog *out, struct oplog **starts, const int *cnts, int k);
+void sort_oplog_refs(struct oplog_ref *refs, int nr);
+size_t merge_oplog_refs(struct oplog_ref *out, struct oplog_ref **starts, const int *cnts, int k);
+
+#ifdef ZERO_COPY_FETCH
+/* Upper sentinel of the global samples */
+static struct oplog max_log;
+#endif
 
 static void collaboratively_sort_logs(struct clustering_workset *ws,
-                                      logs_t *logs, pthread_barrier_t *barrier, int wid) {
-    struct oplog collected_samples[NUM_PFLUSH_WORKER * NUM_PFLUSH_WORKER], *local_sample, *cur_sample;
-    struct oplog *data = logs[wid].logs, *cur, *start, *p, *merged;
+                                      logs_t *logs, worker_barrier_t *barrier, int wid) {
+    flog_t collected_samples[NUM_PFLUSH_WORKER * NUM_PFLUSH_WORKER], *local_sample, *cur_sample;
+    flog_t *data = logs[wid].logs, *cur, *start, *merged;
+    flog_t *run_starts[NUM_PFLUSH_WORKER];
     int nr_collected_sample, nr_global_sample, remain;
     int cnt = logs[wid].cnt, nr_local_sample, i, j;
-    int total, curp[NUM_PFLUSH_WORKER], min_idx;
+    int total, run_cnts[NUM_PFLUSH_WORKER];
     struct sort_contrib *cb;
 
     /* local sort */
-    sort_oplogs(data, cnt);
+    sort_flogs(data, cnt);
 
     /* local sampling */
     nr_local_sample = min(NUM_PFLUSH_WORKER, cnt);
-    local_sample = malloc(sizeof(struct oplog) * nr_local_sample);
+    local_sample = malloc(sizeof(*local_sample) * nr_local_sample);
     for (i = 0, cur = data; i < nr_local_sample; i++, cur += cnt / nr_local_sample) {
         local_sample[i] = *cur;
     }
     ws->local_samples[wid] = local_sample;
     ws->local_sample_cnt[wid] = nr_local_sample;
 
-    pthread_barrier_wait(barrier);
+    worker_barrier_wait(barrier);
 
     /* global sampling */
     if (wid == 0) {
@@ -606,7 +1252,7 @@ static void collaboratively_sort_logs(struct clustering_workset *ws,
         }
 
         /* sort these local samples */
-        sort_oplogs(collected_samples, nr_collected_sample);
+        sort_flogs(collected_samples, nr_collected_sample);
 
         /* sample globally */
         nr_global_sample = min(nr_collected_sample, NUM_PFLUSH_WORKER);
@@ -616,11 +1262,18 @@ static void collaboratively_sort_logs(struct clustering_workset *ws,
             ws->global_samples[i] = *cur_sample;
         }
         for (; i < NUM_PFLUSH_WORKER; i++) {
+#ifdef ZERO_COPY_FETCH
+            max_log.o_kv.k = MAX_KEY;
+            ws->global_samples[i].kprefix = pkey_prefix(max_log.o_kv.k);
+            ws->global_samples[i].stamp = 0;
+            ws->global_samples[i].log = &max_log;
+#else
             ws->global_samples[i].o_kv.k = MAX_KEY;
+#endif
         }
     }
 
-    pthread_barrier_wait(barrier);
+    worker_barrier_wait(barrier);
 
     /* local contribution calculation */
     start = data;
@@ -636,31 +1289,23 @@ static void collaboratively_sort_logs(struct clustering_workset *ws,
     cb->start = start;
     cb->cnt = remain;
 
-    pthread_barrier_wait(barrier);
+    worker_barrier_wait(barrier);
 
     /* local merge */
     total = 0;
     for (i = 0; i < NUM_PFLUSH_WORKER; i++) {
-        total += ws->sort_contribs[i][wid].cnt;
-        curp[i] = 0;
-    }
-    p = merged = malloc(total * sizeof(*merged));
-    for (i = 0; i < total; i++) {
-        min_idx = -1;
-        for (j = 0; j < NUM_PFLUSH_WORKER; j++) {
-            if (curp[j] < ws->sort_contribs[j][wid].cnt && (min_idx == -1 || oplog_cmp(&ws->sort_contribs[j][wid].start[curp[j]], &ws->sort_contribs[min_idx][wid].start[curp[min_idx]]) < 0)) {
-                min_idx = j;
-            }
-        }
-        *p++ = ws->sort_contribs[min_idx][wid].start[curp[min_idx]];
-        curp[min_idx]++;
+        run_starts[i] = ws->sort_contribs[i][wid].start;
+        run_cnts[i] = ws->sort_contribs[i][wid].cnt;
+        total += run_cnts[i];
     }
+    merged = malloc(total * sizeof(*merged));
+    merge_flogs(merged, run_starts, run_cnts, NUM_PFLUSH_WORKER);
 
     /* save result */
     logs[wid].logs = merged;
     logs[wid].cnt = total;
 
-    pthread_barrier_wait(barrier);
+    worker_barrier_wait(barrier);
 
     /* cleanup */
     free(data);
@@ -669,7 +1314,8 @@ static void collaboratively_sort_logs(struct clustering_workset *ws,
 }
 
 static void pbatch_op_add(struct flush_load *per_socket_loads,
-                          pbatch_cursor_t *cursors, int *numa_node, struct oplog *log) {
+                          pbatch_cursor_t *cursors, int *numa_node, flog_t *flog) {
+    struct oplog *log = flog_log(flog);
     struct list_head *cluster_list;
     struct cluster *cluster;
     pbatch_cursor_t *cursor;
@@ -717,11 +1363,11 @@ static void pbatch_op_add(struct flush_load *per_socket_loads,
 
 static void merge_and_cluster_logs(pbatch_op_t **per_socket_pbatch_ops,
                                    struct flush_load *per_socket_loads, logs_t *logs,
-                                   pthread_barrier_t *barrier, int wid) {
+                                   worker_barrier_t *barrier, int wid) {
     int i, next_wid, total = logs[wid].cnt, numa_node = 0;
     struct list_head pbatch_lists[NUM_SOCKET];
     pbatch_cursor_t cursors[NUM_SOCKET];
-    struct oplog *log = logs[wid].logs;
+    flog_t *log = logs[wid].logs;
     pbatch_op_t *ops;
 
     for (i = 0; i < NUM_SOCKET; i++) {
@@ -744,7 +1390,7 @@ static void merge_and_cluster_logs(pbatch_op_t **per_socket_pbatch_ops,
     }
 
     for (; --total; log++) {
-        if (pkey_compare(log[0].o_kv.k, log[1].o_kv.k)) {
+        if (pkey_compare(flog_log(&log[0])->o_kv.k, flog_log(&log[1])->o_kv.k)) {
 			/* merge logs */
             pbatch_op_add(per_socket_loads, cursors, &numa_node, log);
         }
@@ -752,7 +1398,8 @@ static void merge_and_cluster_logs(pbatch_op_t **per_socket_pbatch_ops,
 
     for (next_wid = wid + 1; next_wid < NUM_PFLUSH_WORKER && !logs[next_wid].cnt; next_wid++);
 	
-    if (next_wid >= NUM_PFLUSH_WORKER || pkey_compare(logs[next_wid].logs[0].o_kv.k, log->o_kv.k)) {
+    if (next_wid >= NUM_PFLUSH_WORKER ||
+        pkey_compare(flog_log(&logs[next_wid].logs[0])->o_kv.k, flog_log(log)->o_kv.k)) {
         pbatch_op_add(per_socket_loads, cursors, &numa_node, log);
     }
 
@@ -765,7 +1412,7 @@ static void merge_and_cluster_logs(pbatch_op_t **per_socket_pbatch_ops,
     }
 
 out:
-	pthread_barrier_wait(barrier);
+	worker_barrier_wait(barrier);
 
 	free(logs[wid].logs);
 
@@ -777,14 +1424,14 @@ out:
 
 static void inter_worker_cluster(struct flush_load *per_socket_loads,
                                     struct flush_load per_worker_per_socket_loads[][NUM_SOCKET],
-                                    pthread_barrier_t *barrier, int wid) {
+                                    worker_barrier_t *barrier, int wid) {
     struct flush_load *load, *load_per_worker;
     struct list_head *addon, *target;
     struct cluster *prev, *curr;
     int numa_node, i;
 
     /* Wait for all local cluster to be done. */
-    pthread_barrier_wait(barrier);
+    worker_barrier_wait(barrier);
 
     /* Only one worker per NUMA node. */
     if (worker_nr(wid) != 0) {
@@ -941,14 +1588,40 @@ static void do_inter_socket_load_balance(struct flush_load *per_socket_loads) {
     }
 }
 
+/*
+ * Deal out the clusters of @loads to the workers of its NUMA node, in key
+ * order and about the same number of ops each. Clusters are never split:
+ * this is just where each worker starts, and flush_work steals the rest.
+ */
 static void do_intra_socket_load_balance(struct flush_load *per_worker_loads, struct flush_load *loads,
-                                         int nr_worker) {
-    int nr_busy_worker = (int) (loads->load % nr_worker), i;
-    size_t per_worker_load = loads->load / nr_worker, load;
-    for (i = 0; i < nr_worker; i++) {
-        load = i < nr_busy_worker ? per_worker_load + 1 : per_worker_load;
-        load_split_and_recolor(&per_worker_loads[i], loads, load, loads->color);
+                                         int numa_node) {
+    size_t tot = loads->load, done = 0, len;
+    struct cluster *c, *tmp;
+    struct flush_load *load;
+    int i = 0;
+
+    for (i = 0; i < NUM_PFLUSH_WORKER_PER_NODE; i++) {
+        load = &per_worker_loads[worker_id(numa_node, i)];
+        INIT_LIST_HEAD(&load->cluster);
+        load->load = 0;
+        load->color = loads->color;
+    }
+
+    i = 0;
+    list_for_each_entry_safe(c, tmp, &loads->cluster, list) {
+        len = pbatch_list_len(&c->pbatch_list);
+        /* A cluster goes to the worker whose share holds its middle. */
+        while (i < NUM_PFLUSH_WORKER_PER_NODE - 1 &&
+               done + len / 2 >= (i + 1) * tot / NUM_PFLUSH_WORKER_PER_NODE) {
+            i++;
+        }
+        load = &per_worker_loads[worker_id(numa_node, i)];
+        list_move_tail(&c->list, &load->cluster);
+        load->load += len;
+        done += len;
     }
+
+    loads->load = 0;
 }
 
 static void inter_socket_load_balance(struct flush_load *per_socket_loads, int wid) {
@@ -968,12 +1641,11 @@ static void inter_socket_load_balance(struct flush_load *per_socket_loads, int w
 }
 
 static void intra_socket_load_balance(struct flush_load *per_worker_loads, struct flush_load *per_socket_loads,
-                                      pthread_barrier_t *barrier, int wid) {
-    struct flush_load per_socket_per_worker_loads[NUM_PFLUSH_WORKER_PER_NODE];
+                                      worker_barrier_t *barrier, int wid) {
     int numa_node, i;
 
     /* Wait for inter socket load balance to be done. */
-    pthread_barrier_wait(barrier);
+    worker_barrier_wait(barrier);
 
     /* Only one worker per NUMA node. */
     if (worker_nr(wid) != 0) {
@@ -982,12 +1654,7 @@ static void intra_socket_load_balance(struct flush_load *per_worker_loads, struc
 
     numa_node = worker_numa_node(wid);
 
-    do_intra_socket_load_balance(per_socket_per_worker_loads, &per_socket_loads[numa_node],
-                                 NUM_PFLUSH_WORKER_PER_NODE);
-
-    for (i = 0; i < NUM_PFLUSH_WORKER_PER_NODE; i++) {
-        flush_load_move(&per_worker_loads[worker_id(numa_node, i)], &per_socket_per_worker_loads[i]);
-    }
+    do_intra_socket_load_balance(per_worker_loads, &per_socket_loads[numa_node], numa_node);
 
     for (i = 0; i < NUM_PFLUSH_WORKER_PER_NODE; i++) {
         bonsai_print("[pflush worker %d] intra_socket_load_balance: worker %d [node %d, #%d], %lu logs\n",
@@ -1016,25 +1683,163 @@ static int load_balance_work(void *arg) {
     return 0;
 }
 
+/*
+ * Take a cluster from the load of worker @wid. The owner works from the
+ * head, while thieves take from the tail, away from where it is working.
+ */
+static struct cluster *flush_load_pop(struct flush_workset *ws, int wid, int steal) {
+    struct flush_load *load = &ws->per_worker_loads[wid];
+    struct cluster *c = NULL;
+
+    spin_lock(&ws->load_locks[wid]);
+    if (!list_empty(&load->cluster)) {
+        if (steal) {
+            c = list_last_entry(&load->cluster, struct cluster, list);
+        } else {
+            c = list_first_entry(&load->cluster, struct cluster, list);
+        }
+        list_del(&c->list);
+    }
+    spin_unlock(&ws->load_locks[wid]);
+
+    return c;
+}
+
+/*
+ * Steal a cluster from the siblings on our NUMA node first, then from the
+ * workers of the other nodes. No cluster is added during the flush, so
+ * nothing to steal means that we are done.
+ */
+static struct cluster *flush_load_steal(struct flush_workset *ws, int wid) {
+    int node = worker_numa_node(wid), nr = worker_nr(wid), i, j;
+    struct cluster *c;
+
+    for (i = 0; i < NUM_SOCKET; i++) {
+        for (j = 0; j < NUM_PFLUSH_WORKER_PER_NODE; j++) {
+            if (!i && !j) {
+                continue;
+            }
+            c = flush_load_pop(ws, worker_id((node + i) % NUM_SOCKET, (nr + j) % NUM_PFLUSH_WORKER_PER_NODE), 1);
+            if (c) {
+                return c;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Whether every cluster of this flush has been taken, without taking one. */
+static int flush_load_empty(struct flush_workset *ws) {
+    int wid, empty;
+
+    for (wid = 0; wid < NUM_PFLUSH_WORKER; wid++) {
+        spin_lock(&ws->load_locks[wid]);
+        empty = list_empty(&ws->per_worker_loads[wid].cluster);
+        spin_unlock(&ws->load_locks[wid]);
+        if (!empty) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 static int flush_work(void *arg) {
     struct pflush_work_desc *desc = arg;
     struct flush_workset *ws = desc->workset;
-    struct flush_load *load = &ws->per_worker_loads[desc->wid];
     log_state_t *lst = &LOG(bonsai)->lst;
-    struct cluster *c, *tmp;
+    int nr_cluster = 0, nr_stolen = 0;
+    struct cluster *c;
 
     ws->shim_recycle_chains[desc->wid] = shim_create_recycle_chain();
 
-    list_for_each_entry_safe(c, tmp, &load->cluster, list) {
+    for (;;) {
+        qos_tick();
+
+        /* Parked by the QoS controller: the active workers steal our load. */
+        if (unlikely(!qos_worker_active(desc->wid))) {
+            if (flush_load_empty(ws)) {
+                break;
+            }
+            usleep(QOS_PARK_TIME);
+            continue;
+        }
+
+        c = flush_load_pop(ws, desc->wid, 0);
+        if (!c) {
+            c = flush_load_steal(ws, desc->wid);
+            if (!c) {
+                break;
+            }
+            nr_stolen++;
+        }
+
         // pbatch_list_dump(&c->pbatch_list);
         pnode_run_batch(lst, c->pnode, &c->pbatch_list, ws->shim_recycle_chains[desc->wid]);
         // pbatch_list_dump(&c->pbatch_list);
 
         pbatch_list_destroy(&c->pbatch_list);
-        list_del(&c->list);
         free(c);
+        nr_cluster++;
+
+        qos_pace();
     }
 
+    bonsai_print("[pflush worker %d] flush_work: %d clusters, %d stolen\n", desc->wid, nr_cluster, nr_stolen);
+
+    return 0;
+}
+
+/*
+ * Checkpoint worker: fetch, cluster, load balance and flush back to back
+ * I: the region snapshots
+ *
+ * Only the barriers synchronize the workers, and there is no master round
+ * trip between the stages. A worker sorts its logs as soon as it has
+ * fetched them, while others are still reading the log regions. Clusters
+ * are flushed as soon as the loads are assigned.
+ */
+static int chkpt_work(void *arg) {
+    struct pflush_work_desc *desc = arg, stage = *desc;
+    struct chkpt_workset *cws = desc->workset;
+    struct pflush_worksets *ws = cws->worksets;
+
+    stage.workset = &ws->fetch_ws;
+    fetch_work(&stage);
+
+    stage.workset = &ws->clustering_ws;
+    cluster_work(&stage);
+
+    /* Wait for all the per-socket loads. */
+    worker_barrier_wait(&cws->barrier);
+
+    stage.workset = &ws->load_balance_ws;
+    load_balance_work(&stage);
+
+    /* Wait for all the per-worker loads, and for the unreferenced entries. */
+    worker_barrier_wait(&cws->barrier);
+    if (desc->wid == 0) {
+        end_invalidate_unref_entries(cws->since);
+    }
+    worker_barrier_wait(&cws->barrier);
+
+    stage.workset = &ws->flush_ws;
+    flush_work(&stage);
+
+    return 0;
+}
+
+/*
+ * Rebuild worker: materialize share @wid of the pnode list, but for the
+ * ranges a reader has done already. Workers are numbered node by node, so
+ * each NUMA node takes adjacent ranges.
+ */
+static int rebuild_work(void *arg) {
+    struct pflush_work_desc *desc = arg;
+
+    shim_rebuild_range(desc->wid);
+
     return 0;
 }
 
@@ -1042,17 +1847,42 @@ static void cleanup_logs(const uint32_t *new_region_starts) {
 	struct log_layer *l_layer = LOG(bonsai);
     struct cpu_log_region_desc *desc;
     int cpu;
+#ifdef OPLOG_COMPRESSION
+    uint32_t start, bstart;
+    unsigned seq;
+#endif
     for (cpu = 0; cpu < NUM_CPU; cpu++) {
         desc = &l_layer->desc->descs[cpu];
+#ifdef OPLOG_COMPRESSION
+        start = new_region_starts[cpu];
+        /* Start from the block holding @start. Its earlier logs are skipped by nr. */
+        do {
+            seq = read_seqcount_begin(&desc->seq);
+            bstart = start == desc->end ? desc->bend : desc->cblk[start];
+        } while (read_seqcount_retry(&desc->seq, seq));
+        desc->reclaim_to = start;
+        desc->region->meta.start = CPOS(bstart, start);
+        desc->start = start;
+        desc->bstart = bstart;
+#else
         desc->region->meta.start = desc->start = new_region_starts[cpu];
+#endif
+        bonsai_flush(&desc->region->meta.start, sizeof(desc->region->meta.start), 0);
     }
+    persistent_barrier();
 }
 
 static void init_stage(struct pflush_worksets *worksets) {
+	struct log_layer *l_layer = LOG(bonsai);
 	struct pflush_work_desc* desc;
 	struct thread_info* thread;
 	int i, t = 0;
 
+	/* CPUs without logs keep their region start. */
+	for (i = 0; i < NUM_CPU; i ++) {
+		worksets->fetch_ws.new_region_starts[i] = l_layer->desc->descs[i].start;
+	}
+
 	for (i = 0; i < NUM_PFLUSH_WORKER; i ++) {
 		thread = bonsai->pflush_workers[worker_numa_node(i)][worker_nr(i)];
 		desc = &worksets->desc_ws.desc[t];
@@ -1060,8 +1890,22 @@ static void init_stage(struct pflush_worksets *worksets) {
 		desc->cpu = thread->t_cpu;
 	}
 	
-    pthread_barrier_init(&worksets->clustering_ws.barrier, NULL, NUM_PFLUSH_WORKER);
-    pthread_barrier_init(&worksets->load_balance_ws.barrier, NULL, NUM_PFLUSH_WORKER);
+    worker_barrier_init(&worksets->clustering_ws.barrier, NUM_PFLUSH_WORKER);
+    worker_barrier_init(&worksets->load_balance_ws.barrier, NUM_PFLUSH_WORKER);
+
+    for (i = 0; i < NUM_PFLUSH_WORKER; i++) {
+        spin_lock_init(&worksets->flush_ws.load_locks[i]);
+    }
+}
+
+static void rebuild_stage(struct pflush_worksets *worksets) {
+    struct data_layer *d_layer = DATA(bonsai);
+
+    launch_workers(worksets, rebuild_work, NULL);
+
+    free(d_layer->rebuild_pnos);
+    d_layer->rebuild_pnos = NULL;
+    d_layer->nr_rebuild_pno = 0;
 }
 
 static void fetch_stage(struct pflush_worksets *worksets, logs_t **per_worker_logs) {
@@ -1086,9 +1930,28 @@ static void load_balance_stage(struct pflush_worksets *worksets,
 
 static void flush_stage(struct pflush_worksets *worksets, struct flush_load *per_worker_loads) {
     worksets->flush_ws.per_worker_loads = per_worker_loads;
+    qos_chkpt_begin();
     launch_workers(worksets, flush_work, &worksets->flush_ws);
 }
 
+/* Run the fetch, cluster, load balance and flush stages in one go. */
+static void chkpt_stage(struct pflush_worksets *worksets, unsigned *since) {
+    struct chkpt_workset *cws = &worksets->chkpt_ws;
+
+    fetch_task_alloc(worksets->fetch_ws.fetch_task);
+
+    worksets->clustering_ws.per_worker_logs = worksets->fetch_ws.per_worker_logs;
+    worksets->load_balance_ws.per_socket_loads = worksets->clustering_ws.per_socket_loads;
+    worksets->flush_ws.per_worker_loads = worksets->load_balance_ws.per_worker_loads;
+
+    cws->worksets = worksets;
+    cws->since = since;
+    worker_barrier_init(&cws->barrier, NUM_PFLUSH_WORKER);
+
+    qos_chkpt_begin();
+    launch_workers(worksets, chkpt_work, cws);
+}
+
 static void cleanup_stage(struct pflush_worksets *worksets) {
     cleanup_logs(worksets->fetch_ws.new_region_starts);
 
@@ -1109,24 +1972,39 @@ static void cleanup_stage(struct pflush_worksets *worksets) {
     }
 }
 
+/*
+ * Every checkpoint modifies pnodes. Advance the persistent epoch before it,
+ * so that any index image dumped earlier is known to be stale.
+ */
+static void advance_epoch() {
+    bonsai->desc->epoch++;
+    bonsai_flush(&bonsai->desc->epoch, sizeof(__le64), 1);
+}
+
 /*
  * oplog_flush: perform a full log flush
  */
 void oplog_flush() {
     struct log_layer *l_layer = LOG(bonsai);
-
-    struct flush_load *per_socket_loads, *per_worker_loads;
     struct pflush_worksets ws;
-    logs_t *per_worker_logs;
     unsigned since;
 
 	bonsai_print("thread[%d]: start oplog checkpoint [%d]\n", __this->t_id, l_layer->nflush);
 
 	atomic_set(&l_layer->checkpoint, 1);
 
+    advance_epoch();
+
     new_flip();
     bonsai_print("Enter flip %d\n", l_layer->lst.flip);
 
+    /* Right after the grace period of new_flip */
+    index_layer_gc(INDEX(bonsai));
+
+#ifdef OPLOG_COMPRESSION
+    reclaim_mirror();
+#endif
+
     begin_invalidate_unref_entries(&since);
 
     /* Make sure that all logs in previous flip are written back to NVM. */
@@ -1136,23 +2014,12 @@ void oplog_flush() {
     bonsai_print("oplog_flush: init stage\n");
     init_stage(&ws);
 
-    /* fetch all current-flip logs in NVM to DRAM buffer */
-    bonsai_print("oplog_flush: fetch stage\n");
-    fetch_stage(&ws, &per_worker_logs);
-
-    /* sort, merge, and cluster based on pnode */
-    bonsai_print("oplog_flush: cluster stage\n");
-    cluster_stage(&ws, &per_socket_loads, per_worker_logs);
-
-    /* inter and intra socket load balance */
-    bonsai_print("oplog_flush: balance stage\n");
-    load_balance_stage(&ws, &per_worker_loads, per_socket_loads);
-
-    end_invalidate_unref_entries(&since);
-
-    /* flush and sync */
-    bonsai_print("oplog_flush: flush stage\n");
-    flush_stage(&ws, per_worker_loads);
+    /*
+     * Fetch all current-flip logs to DRAM, sort, merge, and cluster them
+     * based on pnode, balance the loads, then flush and sync.
+     */
+    bonsai_print("oplog_flush: checkpoint stage\n");
+    chkpt_stage(&ws, &since);
 
     /* cleanup work */
     cleanup_stage(&ws);
@@ -1163,23 +2030,150 @@ void oplog_flush() {
 	bonsai_print("thread[%d]: finish log checkpoint [%d]\n", __this->t_id, l_layer->nflush);
 }
 
-static int register_wb_signal() {
-	struct sigaction sa;
-	int ret = 0;
+#ifdef LAZY_RECOVERY
+
+/*
+ * Publish the fetched logs for reads, so that we can serve them before the
+ * logs are replayed and the index is rebuilt.
+ */
+static void serve_recovery_logs(logs_t *per_worker_logs) {
+    struct log_layer *l_layer = LOG(bonsai);
+    struct oplog *logs;
+    int i, j, n = 0, tot = 0;
+
+    for (i = 0; i < NUM_PFLUSH_WORKER; i++) {
+        tot += per_worker_logs[i].cnt;
+    }
+
+    logs = malloc(sizeof(*logs) * (tot ? : 1));
+    for (i = 0; i < NUM_PFLUSH_WORKER; i++) {
+        for (j = 0; j < per_worker_logs[i].cnt; j++) {
+            logs[n++] = *flog_log(&per_worker_logs[i].logs[j]);
+        }
+    }
+
+    sort_oplogs(logs, tot);
+
+    /* Keep the latest one per key. */
+    for (i = 0, n = 0; i < tot; i++) {
+        if (n && !pkey_compare(logs[n - 1].o_kv.k, logs[i].o_kv.k)) {
+            n--;
+        }
+        logs[n++] = logs[i];
+    }
+
+    l_layer->recovery_logs = logs;
+    l_layer->nr_recovery_log = n;
+    smp_mb();
+    ACCESS_ONCE(l_layer->recovery) = RECOVERY_SERVE;
+
+    bonsai_print("oplog_recover: serve %d keys from the logs\n", n);
+}
+
+#endif
 
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = 0;
-	sa.sa_handler = handle_wb;
-	if (sigaction(WB_SIGNO, &sa, NULL) == -1) {
-		perror("sigaction\n");
+/*
+ * Reads during recovery: the logs of the last run are newer than the pnodes.
+ * Return -EAGAIN if @key has no such log.
+ */
+int oplog_recovery_lookup(pkey_t key, pval_t *val) {
+    struct log_layer *l_layer = LOG(bonsai);
+    int lo, hi, mid, cmp, ret = -EAGAIN;
+    struct oplog *log;
+
+    atomic_inc(&l_layer->recovery_readers);
+
+    if (ACCESS_ONCE(l_layer->recovery) != RECOVERY_SERVE) {
         goto out;
-	}
+    }
+
+    for (lo = 0, hi = l_layer->nr_recovery_log; lo < hi; ) {
+        mid = (lo + hi) / 2;
+        log = &l_layer->recovery_logs[mid];
+        cmp = pkey_compare(log->o_kv.k, key);
+        if (!cmp) {
+            if (OPLOG_TYPE(log->o_type) == OP_REMOVE) {
+                ret = -ENOENT;
+            } else {
+                *val = log->o_kv.v;
+                ret = 0;
+            }
+            break;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
 
 out:
-	return ret;
+    atomic_dec(&l_layer->recovery_readers);
+    return ret;
+}
+
+void oplog_wait_recovery() {
+    while (ACCESS_ONCE(LOG(bonsai)->recovery) != RECOVERY_NONE) {
+        usleep(100);
+    }
+}
+
+static void finish_recovery() {
+    struct log_layer *l_layer = LOG(bonsai);
+
+    ACCESS_ONCE(l_layer->recovery) = RECOVERY_NONE;
+    smp_mb();
+
+    while (atomic_read(&l_layer->recovery_readers)) {
+        cpu_relax();
+    }
+
+    free(l_layer->recovery_logs);
+    l_layer->recovery_logs = NULL;
+    l_layer->nr_recovery_log = 0;
+}
+
+/*
+ * oplog_recover: rebuild the DRAM index, then replay the logs left by the
+ * last run. No flip and no write back here: nobody is logging yet.
+ */
+void oplog_recover() {
+    struct log_layer *l_layer = LOG(bonsai);
+
+    struct flush_load *per_socket_loads, *per_worker_loads;
+    struct pflush_worksets ws;
+    logs_t *per_worker_logs;
+    int cpu;
+
+	bonsai_print("thread[%d]: start oplog recovery\n", __this->t_id);
+
+	atomic_set(&l_layer->checkpoint, 1);
+
+    advance_epoch();
+
+    init_stage(&ws);
+    fetch_stage(&ws, &per_worker_logs);
+#ifdef LAZY_RECOVERY
+    serve_recovery_logs(per_worker_logs);
+#endif
+    rebuild_stage(&ws);
+    cluster_stage(&ws, &per_socket_loads, per_worker_logs);
+    load_balance_stage(&ws, &per_worker_loads, per_socket_loads);
+    flush_stage(&ws, per_worker_loads);
+    cleanup_stage(&ws);
+
+    /* Aborted transactions were skipped, count from scratch. */
+    for (cpu = 0; cpu < NUM_CPU; cpu++) {
+        atomic_set(&l_layer->nlogs[cpu].cnt, 0);
+    }
+
+    finish_recovery();
+	atomic_set(&l_layer->checkpoint, 0);
+
+	bonsai_print("thread[%d]: finish oplog recovery\n", __this->t_id);
 }
 
-int log_layer_init(struct log_layer* layer) {
+int log_layer_init(struct log_layer* layer, int format) {
 	int i, ret = 0, node, dimm_idx, dimm, cpu_idx, cpu;
     struct cpu_log_region_desc *desc;
     pthread_mutex_t *dimm_lock;
@@ -1194,8 +2188,12 @@ int log_layer_init(struct log_layer* layer) {
     }
 
 	layer->lst.flip = 0;
+	layer->recovery = RECOVERY_NONE;
+	layer->recovery_logs = NULL;
+	layer->nr_recovery_log = 0;
+	atomic_set(&layer->recovery_readers, 0);
 
-    ret = log_region_init(layer);
+    ret = log_region_init(layer, format);
 	if (ret)
 		goto out;
 
@@ -1215,19 +2213,38 @@ int log_layer_init(struct log_layer* layer) {
 
                 desc = &layer->desc->descs[cpu];
                 desc->region = &layer->dimm_regions[dimm]->regions[i];
+#ifdef OPLOG_COMPRESSION
+                desc->mirror = mirror_alloc(NUM_OPLOG_PER_CPU * sizeof(struct oplog));
+                desc->cblk = mirror_alloc(NUM_OPLOG_PER_CPU * sizeof(uint32_t));
+                decompress_logs(desc);
+                desc->reclaim_from = desc->reclaim_to = desc->start;
+#else
                 desc->start = desc->region->meta.start;
                 desc->end = desc->region->meta.end;
+#endif
+                if (!format) {
+                    atomic_set(&layer->nlogs[cpu].cnt,
+                               (int) ((desc->end - desc->start + NUM_OPLOG_PER_CPU) % NUM_OPLOG_PER_CPU));
+                }
                 desc->lcb_size = 0;
-                desc->lcb = malloc(LCB_MAX_SIZE * sizeof(*desc->lcb));
+                desc->lcb_full_nr = LCB_FULL_NR;
+                desc->lcb_max_nr = LCB_FULL_NR * 2;
+                desc->lcb_fills = 0;
+                desc->lcb_contended = 0;
+                memset(&desc->lcb_stat, 0, sizeof(desc->lcb_stat));
+                desc->throttling = 0;
+                memset(&desc->admit_stat, 0, sizeof(desc->admit_stat));
+                desc->lcb = malloc(desc->lcb_max_nr * sizeof(*desc->lcb));
                 desc->wb_state = WBS_ENABLE;
+                desc->wb_done = 0;
+                desc->stale_lcb = NULL;
+                desc->lsn = desc->durable_lsn = 0;
                 desc->dimm_lock = dimm_lock;
                 seqcount_init(&desc->seq);
             }
         }
     }
 
-    register_wb_signal();
-
 	bonsai_print("log_layer_init\n");
 
 out:
@@ -1243,6 +2260,10 @@ void log_layer_deinit(struct log_layer* layer) {
 			//desc = &layer->desc->descs[cpu];
 		}
 	}
+
+	oplog_dump_stat();
+	chkpt_dump_stat();
+	qos_dump_stat();
 	
 	log_region_deinit(layer);
 
@@ -5,15 +5,301 @@
  */
 
 #include <algorithm>
+#include <vector>
 #include "bonsai.h"
 
+/* Below it, comparison sort wins. */
+#define RADIX_SORT_MIN  1024
+
+#define RADIX_BITS      8
+#define RADIX_SIZE      (1 << RADIX_BITS)
+#define RADIX_DIGITS    (64 / RADIX_BITS)
+
+#define RADIX_DIGIT(key, d)     (((key) >> ((d) * RADIX_BITS)) & (RADIX_SIZE - 1))
+
+/*
+ * In-place MSD radix sort of integer keys, from digit @d down. @key gets
+ * the key of an item, and @less orders the items, which is used for the
+ * small buckets. Digits shared by all the keys are skipped. The first pass
+ * leaves buckets small enough to be sorted in cache, and nothing has to
+ * be allocated, unlike LSD passes over the whole array.
+ */
+template <typename T, typename Key, typename Less>
+static void radix_sort(T *a, size_t n, int d, Key key, Less less) {
+    size_t cnt[RADIX_SIZE], head[RADIX_SIZE], tail[RADIX_SIZE], sum, i;
+    unsigned b, db;
+    T v, t;
+
+    for (;;) {
+        if (n < RADIX_SORT_MIN) {
+            std::sort(a, a + n, less);
+            return;
+        }
+
+        memset(cnt, 0, sizeof(cnt));
+        for (i = 0; i < n; i++) {
+            cnt[RADIX_DIGIT(key(a[i]), d)]++;
+        }
+        if (cnt[RADIX_DIGIT(key(a[0]), d)] != n) {
+            break;
+        }
+        if (!d--) {
+            /* Same keys, order by the rest. */
+            std::sort(a, a + n, less);
+            return;
+        }
+    }
+
+    for (b = 0, sum = 0; b < RADIX_SIZE; b++) {
+        head[b] = sum;
+        sum += cnt[b];
+        tail[b] = sum;
+    }
+
+    /* Permute the items into their buckets, cycle by cycle. */
+    for (b = 0; b < RADIX_SIZE; b++) {
+        while (head[b] < tail[b]) {
+            v = a[head[b]];
+            db = RADIX_DIGIT(key(v), d);
+            while (db != b) {
+                t = a[head[db]];
+                a[head[db]++] = v;
+                v = t;
+                db = RADIX_DIGIT(key(v), d);
+            }
+            a[head[b]++] = v;
+        }
+    }
+
+    for (b = 0, sum = 0; b < RADIX_SIZE; sum += cnt[b++]) {
+        if (cnt[b] > 1) {
+            if (d) {
+                radix_sort(a + sum, cnt[b], d - 1, key, less);
+            } else {
+                std::sort(a + sum, a + sum + cnt[b], less);
+            }
+        }
+    }
+}
+
+#ifndef STR_KEY
+static inline uint64_t oplog_key(const struct oplog &log) {
+    return *(const uint64_t *) log.o_kv.k.key;
+}
+#endif
+
 extern "C" {
 
+#ifndef STR_KEY
+void sort_key_index(struct key_index *ki, int n) {
+    radix_sort(ki, n, RADIX_DIGITS - 1, [](const struct key_index &v) {
+        return v.key;
+    }, [](const struct key_index &v1, const struct key_index &v2) {
+        return v1.key < v2.key;
+    });
+}
+#endif
+
 void sort_oplogs(struct oplog *oplogs, int nr) {
-    /* STL sort is a lot faster than glibc sort... */
-    std::sort(oplogs, oplogs + nr, [](const struct oplog &v1, const struct oplog &v2) {
+    auto less = [](const struct oplog &v1, const struct oplog &v2) {
         return oplog_cmp(&v1, &v2) < 0;
+    };
+#ifndef STR_KEY
+    radix_sort(oplogs, nr, RADIX_DIGITS - 1, oplog_key, less);
+#else
+    /* STL sort is a lot faster than glibc sort... */
+    std::sort(oplogs, oplogs + nr, less);
+#endif
+}
+
+/* Radix on the key prefix, and only look at the logs for equal prefixes. */
+void sort_oplog_refs(struct oplog_ref *refs, int nr) {
+    radix_sort(refs, nr, RADIX_DIGITS - 1, [](const struct oplog_ref &v) {
+        return v.kprefix;
+    }, [](const struct oplog_ref &v1, const struct oplog_ref &v2) {
+        return oplog_ref_cmp(&v1, &v2) < 0;
     });
 }
 
 }
+
+/* Take this many logs in a row from one run before galloping in it. */
+#define MIN_GALLOP      7
+
+namespace {
+
+inline int item_cmp(const struct oplog *a, const struct oplog *b) {
+    return oplog_cmp(a, b);
+}
+
+inline int item_cmp(const struct oplog_ref *a, const struct oplog_ref *b) {
+    return oplog_ref_cmp(a, b);
+}
+
+template <typename T>
+struct merge_run {
+    T *cur, *end;
+};
+
+/*
+ * Loser tree over @k runs. Leaves are implicit at [k, 2k), and internal
+ * node i keeps the loser of the match between its children. Exhausted
+ * runs lose to everything. Ties go to the lower run.
+ */
+template <typename T>
+class loser_tree {
+public:
+    loser_tree(merge_run<T> *runs, int k) : runs_(runs), k_(k), tree_(k) {
+        winner_ = k > 1 ? build(1) : 0;
+    }
+
+    int winner() const { return winner_; }
+
+    /* Replay the matches of the winner after its run advanced. */
+    void replay() {
+        int w = winner_;
+        for (int node = (w + k_) / 2; node >= 1; node /= 2) {
+            if (less(tree_[node], w)) {
+                int t = tree_[node];
+                tree_[node] = w;
+                w = t;
+            }
+        }
+        winner_ = w;
+    }
+
+    /* The second best run, which only lost to the winner on its way up. */
+    int runner_up() const {
+        int r = -1;
+        for (int node = (winner_ + k_) / 2; node >= 1; node /= 2) {
+            if (r < 0 || less(tree_[node], r)) {
+                r = tree_[node];
+            }
+        }
+        return r;
+    }
+
+    bool less(int a, int b) const {
+        if (runs_[a].cur == runs_[a].end) {
+            return false;
+        }
+        if (runs_[b].cur == runs_[b].end) {
+            return true;
+        }
+        int c = item_cmp(runs_[a].cur, runs_[b].cur);
+        return c < 0 || (c == 0 && a < b);
+    }
+
+private:
+    int build(int node) {
+        if (node >= k_) {
+            return node - k_;
+        }
+        int l = build(node * 2), r = build(node * 2 + 1);
+        if (less(l, r)) {
+            tree_[node] = r;
+            return l;
+        }
+        tree_[node] = l;
+        return r;
+    }
+
+    merge_run<T> *runs_;
+    int k_, winner_;
+    std::vector<int> tree_;
+};
+
+/* How many logs at the head of run @w go before the head of run @r. */
+template <typename T>
+size_t gallop(merge_run<T> *runs, int w, int r) {
+    T *base = runs[w].cur, *bound;
+    size_t n = runs[w].end - base, lo = 0, hi = 1;
+
+    if (r < 0 || runs[r].cur == runs[r].end) {
+        return n;
+    }
+    bound = runs[r].cur;
+
+    auto before = [&](size_t i) {
+        int c = item_cmp(&base[i], bound);
+        return c < 0 || (c == 0 && w < r);
+    };
+
+    /* Exponential search, then binary search in the last step. */
+    while (hi < n && before(hi)) {
+        lo = hi;
+        hi = hi * 2 + 1;
+    }
+    if (hi > n) {
+        hi = n;
+    }
+    while (lo + 1 < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (before(mid)) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo + 1;
+}
+
+/*
+ * k-way merge of sorted runs into @out, return the count
+ * O(n log k) with a loser tree. A run that keeps winning is copied in bulk,
+ * up to the head of the second best run.
+ */
+template <typename T>
+size_t merge_runs(T *out, T **starts, const int *cnts, int k) {
+    std::vector<merge_run<T>> runs(k);
+    T *p = out;
+    int streak = 0, last = -1;
+    size_t n;
+
+    for (int i = 0; i < k; i++) {
+        runs[i].cur = starts[i];
+        runs[i].end = starts[i] + cnts[i];
+    }
+
+    loser_tree<T> lt(runs.data(), k);
+
+    for (;;) {
+        int w = lt.winner();
+        merge_run<T> *run = &runs[w];
+
+        if (run->cur == run->end) {
+            break;
+        }
+
+        streak = w == last ? streak + 1 : 1;
+        last = w;
+
+        if (streak >= MIN_GALLOP) {
+            n = gallop(runs.data(), w, lt.runner_up());
+            std::copy(run->cur, run->cur + n, p);
+            p += n;
+            run->cur += n;
+            streak = 0;
+        } else {
+            *p++ = *run->cur++;
+        }
+
+        lt.replay();
+    }
+
+    return p - out;
+}
+
+}
+
+extern "C" {
+
+size_t merge_oplogs(struct oplog *out, struct oplog **starts, const int *cnts, int k) {
+    return merge_runs(out, starts, cnts, k);
+}
+
+size_t merge_oplog_refs(struct oplog_ref *out, struct oplog_ref **starts, const int *cnts, int k) {
+    return merge_runs(out, starts, cnts, k);
+}
+
+}
@@ -1603,43 +1603,71 @@ delayer:
 	return false;
 }
 
+/*
+ * gc_node_size: the bytes to free for a garbage-collected node, and the
+ * next one in @next.
+ */
+static size_t
+gc_node_size(masstree_t *tree, mtree_node_t *node, mtree_node_t **next)
+{
+	const uint32_t v = node->version;
+
+	ASSERT((v & (NODE_DELETED | NODE_DELAYER)) != 0);
+
+	if (v & NODE_ISBORDER) {
+		*next = cast_to_leaf(node)->gc_next;
+	} else {
+		*next = cast_to_inode(node)->gc_next;
+	}
+	if (node == (mtree_node_t *)&tree->initleaf) {
+		return 0;
+	}
+	return (v & NODE_ISBORDER) ? sizeof(mtree_leaf_t) : sizeof(mtree_inode_t);
+}
+
+/*
+ * masstree_gc_prepare: take the garbage-collected nodes so far, and
+ * return their size in @bytes.  Pass them to masstree_gc once nobody
+ * can be reading them.
+ */
 void *
-masstree_gc_prepare(masstree_t *tree)
+masstree_gc_prepare(masstree_t *tree, size_t *bytes)
 {
-	mtree_node_t *gc_nodes = NULL;
+	mtree_node_t *gc_nodes = NULL, *node, *next;
 
 	do {
 		gc_nodes = tree->gc_nodes;
 	} while (!atomic_compare_exchange_weak(&tree->gc_nodes, gc_nodes, NULL));
 
+	*bytes = 0;
+	for (node = gc_nodes; node; node = next) {
+		*bytes += gc_node_size(tree, node, &next);
+	}
+
 	return gc_nodes;
 }
 
 /*
- * masstree_gc: destroy all the garbage-collected nodes.
+ * masstree_gc: destroy all the garbage-collected nodes, return the
+ * bytes freed.
  */
-void
+size_t
 masstree_gc(masstree_t *tree, void *gc)
 {
 	const masstree_ops_t *ops = tree->ops;
 	mtree_node_t *node = gc, *next;
+	size_t size, freed = 0;
 
 	while (node) {
-		const uint32_t v = node->version;
-
-		ASSERT((v & (NODE_DELETED | NODE_DELAYER)) != 0);
-
-		if (v & NODE_ISBORDER) {
-			next = cast_to_leaf(node)->gc_next;
-		} else {
-			next = cast_to_inode(node)->gc_next;
-		}
-		if (node != (mtree_node_t *)&tree->initleaf) {
-			ops->free(node, (v & NODE_ISBORDER) ?
-			    sizeof(mtree_leaf_t) : sizeof(mtree_inode_t));
+		size = gc_node_size(tree, node, &next);
+		if (size) {
+			ops->free(node, size);
+			freed += size;
 		}
 		node = next;
 	}
+
+	return freed;
 }
 
 masstree_t *
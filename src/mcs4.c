@@ -18,8 +18,6 @@ struct qnode {
     int spin;
 } ____cacheline_aligned2;
 
-#define NULL_QNODE          (-1)
-
 #define MAX_NR_THREADS      128
 #define MAX_HOLDING_LOCKS   3
 
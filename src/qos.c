@@ -0,0 +1,181 @@
+/*
+ * BonsaiKV: Towards Fast, Scalable, and Persistent Key-Value Stores with Tiered, Heterogeneous Memory System
+ *
+ * Flush QoS: trade checkpoint throughput for foreground tail latency
+ */
+
+#define _GNU_SOURCE
+#include "cpu.h"
+#include <unistd.h>
+
+#include "bonsai.h"
+#include "thread.h"
+#include "qos.h"
+
+#ifdef FLUSH_QOS
+
+struct qos_hist {
+    unsigned long cnt[QOS_NR_BUCKET];
+} ____cacheline_aligned;
+
+__thread unsigned qos_nr_op;
+
+/* Per CPU, so the users don't share the cache lines. */
+static struct qos_hist hists[NUM_CPU];
+
+static struct {
+    unsigned long target;
+    int nr_active, pace;
+
+    long next_tick;
+    int ticking;
+    unsigned long last[QOS_NR_BUCKET]; /* the histogram at the last tick */
+
+    struct qos_stat stat;
+} qos = {
+    .target = QOS_P99_TARGET,
+    .nr_active = NUM_PFLUSH_WORKER,
+    .stat.min_active = NUM_PFLUSH_WORKER
+};
+
+void qos_record(long ns) {
+    long b = ns / QOS_BUCKET_NS;
+    if (b >= QOS_NR_BUCKET) {
+        b = QOS_NR_BUCKET - 1;
+    }
+    hists[__this->t_cpu].cnt[b]++;
+}
+
+void qos_set_target(unsigned long ns) {
+    ACCESS_ONCE(qos.target) = ns;
+}
+
+/* Sum up the histograms, and return the samples since the last tick in @win. */
+static unsigned long qos_window(unsigned long *win) {
+    unsigned long tot = 0, cur;
+    int b, cpu;
+
+    for (b = 0; b < QOS_NR_BUCKET; b++) {
+        cur = 0;
+        for (cpu = 0; cpu < NUM_CPU; cpu++) {
+            cur += ACCESS_ONCE(hists[cpu].cnt[b]);
+        }
+        win[b] = cur - qos.last[b];
+        qos.last[b] = cur;
+        tot += win[b];
+    }
+
+    return tot;
+}
+
+static unsigned long qos_percentile(const unsigned long *win, unsigned long tot) {
+    unsigned long seen = 0, need = (tot * QOS_PERCENTILE + 99) / 100;
+    int b;
+
+    for (b = 0; b < QOS_NR_BUCKET - 1; b++) {
+        seen += win[b];
+        if (seen >= need) {
+            break;
+        }
+    }
+
+    return (unsigned long) (b + 1) * QOS_BUCKET_NS;
+}
+
+/* Only look at the latency during the checkpoint. */
+void qos_chkpt_begin() {
+    unsigned long win[QOS_NR_BUCKET];
+
+    qos_window(win);
+    qos.next_tick = qos_now() + QOS_INTERVAL;
+}
+
+/*
+ * qos_tick: adjust the flush workers to the foreground latency
+ * Called by the flush workers between clusters. Over the target, halve
+ * the active workers, which also takes the contention on the inodes away,
+ * and pace the last ones. Well under it, undo it step by step.
+ */
+void qos_tick() {
+    unsigned long win[QOS_NR_BUCKET], tot, pct, target;
+    long now = qos_now();
+    int nr_active, pace;
+
+    if (now < ACCESS_ONCE(qos.next_tick) || cmpxchg(&qos.ticking, 0, 1)) {
+        return;
+    }
+
+    tot = qos_window(win);
+    target = ACCESS_ONCE(qos.target);
+    nr_active = qos.nr_active;
+    pace = qos.pace;
+
+    if (tot < QOS_MIN_SAMPLES) {
+        /* Hardly any foreground to protect. */
+        pct = 0;
+        nr_active = NUM_PFLUSH_WORKER;
+        pace = 0;
+    } else {
+        pct = qos_percentile(win, tot);
+        if (pct > target) {
+            if (nr_active > QOS_MIN_WORKER) {
+                nr_active = max(nr_active / 2, QOS_MIN_WORKER);
+            } else {
+                pace = min(pace * 2 + QOS_PACE_STEP, QOS_MAX_PACE);
+            }
+            qos.stat.nr_slowdown++;
+        } else if (pct < target * 3 / 4) {
+            if (pace) {
+                pace = pace / 2 < QOS_PACE_STEP ? 0 : pace / 2;
+                qos.stat.nr_speedup++;
+            } else if (nr_active < NUM_PFLUSH_WORKER) {
+                nr_active++;
+                qos.stat.nr_speedup++;
+            }
+        }
+    }
+
+    ACCESS_ONCE(qos.nr_active) = nr_active;
+    ACCESS_ONCE(qos.pace) = pace;
+
+    qos.stat.nr_tick++;
+    qos.stat.last_pct = pct;
+    qos.stat.min_active = min(qos.stat.min_active, nr_active);
+    qos.stat.max_pace = max(qos.stat.max_pace, pace);
+
+    ACCESS_ONCE(qos.next_tick) = now + QOS_INTERVAL;
+    smp_mb();
+    ACCESS_ONCE(qos.ticking) = 0;
+}
+
+/* Spread the active workers over the NUMA nodes. */
+int qos_worker_active(int wid) {
+    int rank = (wid % NUM_PFLUSH_WORKER_PER_NODE) * NUM_SOCKET + wid / NUM_PFLUSH_WORKER_PER_NODE;
+    return rank < ACCESS_ONCE(qos.nr_active);
+}
+
+void qos_pace() {
+    int pace = ACCESS_ONCE(qos.pace);
+    if (pace) {
+        usleep(pace);
+    }
+}
+
+void qos_stat(struct qos_stat *stat) {
+    *stat = qos.stat;
+    stat->target = qos.target;
+    stat->nr_active = qos.nr_active;
+    stat->pace = qos.pace;
+}
+
+void qos_dump_stat() {
+    struct qos_stat stat;
+
+    qos_stat(&stat);
+    bonsai_print("flush qos: p%d target %lu ns, last %lu ns, %lu ticks, %lu slowdowns, %lu speedups, "
+                 "%d workers (min %d), pace %d us (max %d)\n",
+                 QOS_PERCENTILE, stat.target, stat.last_pct, stat.nr_tick, stat.nr_slowdown, stat.nr_speedup,
+                 stat.nr_active, stat.min_active, stat.pace, stat.max_pace);
+}
+
+#endif
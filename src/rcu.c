@@ -126,10 +126,16 @@ int rcu_now(rcu_t *rcu) {
  * since @since, which can be derived from @rcu_now.
  */
 void rcu_synchronize(rcu_t *rcu, int since) {	
+    useconds_t backoff = 1;
+
 	smp_mb();
 
+    /* Grace periods are short under load. Back off from a short sleep. */
     while (atomic64_read(&rcu->fb.thr_bmp) && ACCESS_ONCE(rcu->fb_cnt) - since < 2) {
-        usleep(1000);
+        usleep(backoff);
+        if (backoff < 1000) {
+            backoff *= 2;
+        }
     }
 }
 
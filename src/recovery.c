@@ -5,8 +5,189 @@
  */
 
 #define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "bonsai.h"
+#include "config.h"
+#include "data_layer.h"
+#include "log_layer.h"
+
+#ifdef ENABLE_INDEX_IMAGE
+
+#define INDEX_IMAGE_MAGIC       0x626e7369u     /* "bnsi" */
+#define INDEX_IMAGE_VERSION     2
+
+static char *index_image_fpath = "/mnt/ext4/dimm0/bonsai_image";
+
+/*
+ * The DRAM index image: the shim leader inode chain in key order, as the
+ * pnode behind each inode and its lfence, which is also its Masstree key.
+ * That's all the restart needs to build the placeholder inodes and index
+ * them, without reading a single pnode. The pnodes are read later, when
+ * their range is materialized, see @shim_rebuild_init. Only valid if no
+ * checkpoint ran after it was written (@epoch), so it's written at a clean
+ * shutdown only: a crash always walks the pnode list.
+ */
+struct index_image_ent {
+	pnoid_t pno;
+	pkey_t lfence;
+}__packed;
+
+struct index_image {
+	__le32 magic;
+	__le32 version;
+	__le64 epoch;
+	__le32 sentinel;
+	__le32 nr;
+	struct index_image_ent ents[0];
+}__packed;
+
+/*
+ * index_image_dump: write the DRAM index image of the current epoch
+ * Called at shutdown, once the pflush threads are gone, so that the pnode
+ * list is stable.
+ */
+void index_image_dump() {
+	struct index_image *img;
+	pnoid_t sentinel, pno;
+	int fd, nr = 0;
+	size_t size;
+
+	sentinel = DATA(bonsai)->sentinel;
+	for (pno = sentinel; pno != PNOID_NULL; pno = pnode_next(pno)) {
+		nr++;
+	}
+	size = sizeof(struct index_image) + nr * sizeof(struct index_image_ent);
+
+	if ((fd = open(index_image_fpath, O_CREAT|O_RDWR, 0666)) < 0) {
+		perror("open");
+		return;
+	}
+
+	if (posix_fallocate(fd, 0, size) != 0) {
+		perror("posix_fallocate");
+		goto out_close;
+	}
+
+	img = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FILE, fd, 0);
+	if (img == MAP_FAILED) {
+		perror("mmap");
+		goto out_close;
+	}
+
+	/* Invalidate the old image first, a torn image must never be taken. */
+	img->magic = 0;
+	bonsai_flush(&img->magic, sizeof(__le32), 1);
+
+	nr = 0;
+	for (pno = sentinel; pno != PNOID_NULL; pno = pnode_next(pno)) {
+		img->ents[nr].pno = pno;
+		img->ents[nr++].lfence = pnode_get_lfence(pno);
+	}
+	img->version = INDEX_IMAGE_VERSION;
+	img->epoch = bonsai->desc->epoch;
+	img->sentinel = sentinel;
+	img->nr = nr;
+	bonsai_flush(img, size, 1);
+
+	img->magic = INDEX_IMAGE_MAGIC;
+	bonsai_flush(&img->magic, sizeof(__le32), 1);
+
+	munmap(img, size);
+
+	bonsai_print("index image dumped: epoch %lu, %d pnodes\n", (unsigned long) bonsai->desc->epoch, nr);
 
+out_close:
+	close(fd);
+}
+
+/*
+ * index_image_load: load the pnode list and their lfences from an
+ * up-to-date image. Return the number of pnodes and set @pnos and
+ * @lfences on success, or -ENOENT.
+ */
+static int index_image_load(pnoid_t **pnos, pkey_t **lfences) {
+	struct index_image *img;
+	int fd, ret = -ENOENT;
+	struct stat st;
+	uint32_t i;
+
+	if ((fd = open(index_image_fpath, O_RDONLY)) < 0) {
+		return -ENOENT;
+	}
+
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct index_image)) {
+		goto out_close;
+	}
+
+	img = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED|MAP_FILE, fd, 0);
+	if (img == MAP_FAILED) {
+		perror("mmap");
+		goto out_close;
+	}
+
+	if (img->magic != INDEX_IMAGE_MAGIC || img->version != INDEX_IMAGE_VERSION ||
+	    img->epoch != bonsai->desc->epoch || img->sentinel != bonsai->desc->pnode_sentinel ||
+	    sizeof(struct index_image) + img->nr * sizeof(struct index_image_ent) > (size_t) st.st_size) {
+		bonsai_print("index image is stale or broken, walk the pnode list\n");
+		goto out_unmap;
+	}
+
+	*pnos = malloc(img->nr * sizeof(pnoid_t));
+	*lfences = malloc(img->nr * sizeof(pkey_t));
+	for (i = 0; i < img->nr; i++) {
+		(*pnos)[i] = img->ents[i].pno;
+		(*lfences)[i] = img->ents[i].lfence;
+	}
+	ret = (int) img->nr;
+
+out_unmap:
+	munmap(img, st.st_size);
+out_close:
+	close(fd);
+	return ret;
+}
+
+#endif
+
+/*
+ * bonsai_recover: rebuild the volatile state after a restart
+ * 1. take the pnode list from the index image left by a clean shutdown,
+ *    or walk it on NVM, and rebuild the pnode free list
+ * 2. cut the list into ranges, one placeholder inode per range, indexed
+ *    by the lfences of the image if any, so no pnode is read till then
+ * 3. let the pflush workers fetch the logs left in NVM, materialize the
+ *    ranges in parallel, and replay the logs. With LAZY_RECOVERY, reads
+ *    are served as soon as the logs are fetched, and materialize the
+ *    ranges they hit on demand.
+ */
 void bonsai_recover() {
-  /* TODO */
+	pkey_t *lfences = NULL;
+	pnoid_t *pnos = NULL;
+	int nr = 0;
+
+	bonsai_print("bonsai recover start\n");
+
+#ifdef ENABLE_INDEX_IMAGE
+	nr = index_image_load(&pnos, &lfences);
+	if (nr < 0) {
+		pnos = NULL;
+		lfences = NULL;
+		nr = 0;
+	}
+#endif
+
+	pnode_recover(pnos, nr);
+	shim_rebuild_init(DATA(bonsai)->rebuild_pnos, lfences, DATA(bonsai)->nr_rebuild_pno);
+	free(lfences);
+
+	LOG(bonsai)->recovery = RECOVERY_FETCH;
+
+	bonsai_print("bonsai recover: pnode list collected, rebuild and replay in pflush threads\n");
 }
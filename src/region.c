@@ -70,7 +70,7 @@ static char* pval_region_fpath[NUM_DIMM] = {
 	"/mnt/ext4/dimm11/pvalpool",
 };
 
-int log_region_init(struct log_layer *layer) {
+int log_region_init(struct log_layer *layer, int format) {
     size_t size_per_dimm = sizeof(struct dimm_log_region);
 	int dimm, cpu, fd, ret = 0;
     void *vaddr;
@@ -103,9 +103,11 @@ int log_region_init(struct log_layer *layer) {
 		layer->dimm_regions[dimm] = vaddr;
 		layer->dimm_region_fd[dimm] = fd;
 
-		for (cpu = 0; cpu < NUM_CPU_PER_DIMM; cpu ++) {
+		/* Keep the logs of the last run for recovery. */
+		for (cpu = 0; format && cpu < NUM_CPU_PER_DIMM; cpu ++) {
 			layer->dimm_regions[dimm]->regions[cpu].meta.start = 
 				layer->dimm_regions[dimm]->regions[cpu].meta.end = 0;
+			bonsai_flush(&layer->dimm_regions[dimm]->regions[cpu].meta, sizeof(struct cpu_log_region_meta), 0);
 		}
 
 		bonsai_print("log_region_init dimm[%d] region: [%016lx, %016lx]\n",
@@ -3,8 +3,10 @@
  *
  * Bonsai thread configuration:
  *
- * self | master | pflush | pflush | pflush | pflush | smo
+ * self | master | pflush | pflush | pflush | pflush | smo | ... | smo
  *                      node0              node1
+ *
+ * Each smo thread applies the SMOs of a hash partition of the keys.
  */
 
 #define _GNU_SOURCE
@@ -12,6 +14,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 
 #include "thread.h"
@@ -20,6 +23,7 @@
 #include "bonsai.h"
 #include "log_layer.h"
 #include "index_layer.h"
+#include "chkpt.h"
 
 __thread struct thread_info* __this = NULL;
 
@@ -27,16 +31,19 @@ static pthread_mutex_t work_mutex;
 static pthread_cond_t work_cond;
 
 static atomic_t STATUS = ATOMIC_INIT(MASTER_SLEEP);
-static atomic_t RECEIVED = ATOMIC_INIT(0);
+
+/* Works queued but not done yet, and whether the master sleeps on it. */
+static atomic_t pending_works = ATOMIC_INIT(0);
+static int master_waiting;
 
 static atomic_t tids = ATOMIC_INIT(-1);
 
-static pthread_mutex_t smo_mutex;
-static pthread_cond_t smo_cond;
+int pflush_spin;
 
-static atomic_t SMO_STATUS = ATOMIC_INIT(SMO_SLEEP);
+static pthread_mutex_t smo_mutex[NUM_SMO_THREAD];
+static pthread_cond_t smo_cond[NUM_SMO_THREAD];
 
-void do_smo();
+static atomic_t SMO_STATUS[NUM_SMO_THREAD];
 
 extern struct bonsai_info* bonsai;
 
@@ -46,25 +53,56 @@ inline int get_tid() {
 
 static void init_workqueue(struct thread_info* thread, struct workqueue_struct* wq) {
 	wq->thread = thread;
-	INIT_LIST_HEAD(&wq->head);
+	INIT_KFIFO(wq->works);
+	wq->sleeping = 0;
 }
 
-void wakeup_workers() {
-	pthread_mutex_lock(&work_mutex);
-	atomic_set(&STATUS, WORKER_RUNNING);
-	atomic_set(&RECEIVED, 0);
-	pthread_cond_broadcast(&work_cond);
-	pthread_mutex_unlock(&work_mutex);
+static void wakeup_worker(struct workqueue_struct* wq) {
+	smp_mb();
+	if (ACCESS_ONCE(wq->sleeping)) {
+		/* Let a worker on its way to sleep see the change. */
+		ACCESS_ONCE(wq->sleeping) = 0;
+		futex_wake(&wq->sleeping);
+	}
 }
 
-static void try_wakeup_master() {
-	while (atomic_read(&RECEIVED) != WORKER_RUNNING) {
-        cpu_relax();
-    }
-	if (atomic_sub_return(1, &STATUS) == WORKER_SLEEP) {
-		pthread_mutex_lock(&work_mutex);
-		pthread_cond_broadcast(&work_cond);
-		pthread_mutex_unlock(&work_mutex);
+/* Hand a work to pflush worker @thread. Only the master queues works. */
+void queue_work(struct thread_info *thread, work_func_t exec, void *arg) {
+	struct workqueue_struct* wq = &thread->t_wq;
+
+	atomic_inc(&pending_works);
+	while (!kfifo_put(&wq->works, ((struct work_struct) { exec, arg }))) {
+		cpu_relax();
+	}
+	wakeup_worker(wq);
+}
+
+/* Wait until all the queued works are done. */
+void wait_works() {
+	int spin, pending;
+
+	for (spin = 0; spin < pflush_spin; spin++) {
+		if (!atomic_read(&pending_works)) {
+			return;
+		}
+		cpu_relax();
+	}
+
+	for (;;) {
+		ACCESS_ONCE(master_waiting) = 1;
+		smp_mb();
+		pending = (int) atomic_read(&pending_works);
+		if (!pending) {
+			break;
+		}
+		futex_wait((int *) &pending_works.counter, pending);
+	}
+	ACCESS_ONCE(master_waiting) = 0;
+}
+
+static void work_done() {
+	if (atomic_sub_return(1, &pending_works) == 0 && ACCESS_ONCE(master_waiting)) {
+		futex_wake((int *) &pending_works.counter);
 	}
 }
 
@@ -78,80 +116,94 @@ void wakeup_master() {
 	pthread_mutex_unlock(&work_mutex);
 }
 
-void park_workers() {
-	pthread_mutex_lock(&work_mutex);
-	atomic_set(&STATUS, WORKER_SLEEP);
-	pthread_mutex_unlock(&work_mutex);
-}
-
 void park_master() {
 	pthread_mutex_lock(&work_mutex);
-	while (atomic_read(&STATUS) != WORKER_SLEEP 
-			&& atomic_read(&STATUS) != ALL_WAKEUP
+	while (atomic_read(&STATUS) != ALL_WAKEUP
 			&& atomic_read(&STATUS) != MASTER_WORK)
 		pthread_cond_wait(&work_cond, &work_mutex);
 	pthread_mutex_unlock(&work_mutex);
 }
 
-static void worker_sleep() {
+/* Like @park_master, but give up after @usec. Return -ETIMEDOUT if so. */
+int park_master_timeout(long usec) {
+	struct timespec ts;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += usec * 1000;
+	ts.tv_sec += ts.tv_nsec / 1000000000;
+	ts.tv_nsec %= 1000000000;
+
 	pthread_mutex_lock(&work_mutex);
-	while (atomic_read(&STATUS) != WORKER_RUNNING 
-			&& atomic_read(&STATUS) != ALL_WAKEUP) {
-		pthread_cond_wait(&work_cond, &work_mutex);
+	while (atomic_read(&STATUS) != ALL_WAKEUP
+			&& atomic_read(&STATUS) != MASTER_WORK) {
+		if (pthread_cond_timedwait(&work_cond, &work_mutex, &ts) == ETIMEDOUT) {
+			ret = -ETIMEDOUT;
+			break;
+		}
 	}
-	atomic_inc(&RECEIVED);
 	pthread_mutex_unlock(&work_mutex);
+
+	return ret;
+}
+
+/* Spin for a while, then sleep until there is a work or we exit. */
+static void worker_sleep(struct workqueue_struct* wq) {
+	struct log_layer *layer = LOG(bonsai);
+	int spin;
+
+	for (spin = 0; spin < pflush_spin; spin++) {
+		if (!kfifo_is_empty(&wq->works) || atomic_read(&layer->exit)) {
+			return;
+		}
+		cpu_relax();
+	}
+
+	for (;;) {
+		ACCESS_ONCE(wq->sleeping) = 1;
+		smp_mb();
+		if (!kfifo_is_empty(&wq->works) || atomic_read(&layer->exit)) {
+			break;
+		}
+		futex_wait(&wq->sleeping, 1);
+	}
+	ACCESS_ONCE(wq->sleeping) = 0;
 }
 
 static void wakeup_all() {
+	int node, i;
+
 	pthread_mutex_lock(&work_mutex);
 	atomic_set(&STATUS, ALL_WAKEUP);
-	atomic_set(&RECEIVED, 0);
 	pthread_cond_broadcast(&work_cond);
 	pthread_mutex_unlock(&work_mutex);
+
+	for (node = 0; node < NUM_SOCKET; node++) {
+		for (i = 0; i < NUM_PFLUSH_WORKER_PER_NODE; i++) {
+			wakeup_worker(&bonsai->pflush_workers[node][i]->t_wq);
+		}
+	}
 }
 
 static void wait_pflush_thread() {
-	int states[NUM_PFLUSH_THREAD] = {0};
-	int i, num_sleep = 0;
-
-	while (1) {
-		for (i = 0; i < NUM_PFLUSH_THREAD; i ++) {
-			if (bonsai->pflush_threads[i]->t_state != S_SLEEPING)
-				usleep(20);
-			else
-				states[i] = 1;
-		}
+	int i;
 
-		for (i = 0; i < NUM_PFLUSH_THREAD; i ++) {
-			if (states[i]) num_sleep ++;
+	for (i = 0; i < NUM_PFLUSH_THREAD; i ++) {
+		while (ACCESS_ONCE(bonsai->pflush_threads[i]->t_state) != S_SLEEPING) {
+			cpu_relax();
 		}
-
-		if (num_sleep == NUM_PFLUSH_THREAD)
-			return;
-
-		num_sleep = 0;
 	}
 }
 
 static void thread_work(struct workqueue_struct* wq) {
-	struct work_struct* work, *tmp;
-	int ret = 0;
+	struct work_struct work;
 
 	bonsai_debug("worker thread[%d] start to work\n", __this->t_id);
 
-	if (likely(list_empty(&wq->head)))
-		return;
-
-	list_for_each_entry_safe(work, tmp, &wq->head, list) {
-        ret = work->exec(work->exec_arg);
-		workqueue_del(work);
-
-		if (unlikely(ret)) 
-			return;
+	while (kfifo_get(&wq->works, &work)) {
+		work.exec(work.exec_arg);
+		work_done();
 	}
-
-	try_wakeup_master();
 }
 
 static void pflush_thread_exit(struct thread_info* thread) {
@@ -189,7 +241,7 @@ static void pflush_worker(struct thread_info* this) {
 	
 	while (!atomic_read(&layer->exit)) {
 		__this->t_state = S_SLEEPING;
-		worker_sleep();
+		worker_sleep(&__this->t_wq);
 		
 		__this->t_state = S_RUNNING;
 		thread_work(&__this->t_wq);
@@ -219,21 +271,11 @@ static void master_wait_workers(struct thread_info* master) {
 	}
 }
 
-static inline int need_flush_log() {
-	struct log_layer *layer = LOG(bonsai);
-    int cpu, total = 0;
-    for (cpu = 0; cpu < NUM_CPU; cpu++) {
-        total += atomic_read(&layer->nlogs[cpu].cnt);
-		bonsai_debug("cpu[%d] %d\n", cpu, atomic_read(&layer->nlogs[cpu].cnt));
-        if (total >= CHKPT_NLOG_INTERVAL) {
-            return 1;
-        }
-    }
-    return 0;
-}
-
 static void pflush_master(struct thread_info* this) {
 	struct log_layer *layer = LOG(bonsai);
+	enum chkpt_reason reason;
+	long poll_time;
+	int timeout;
 	
 	__this = this;
 	__this->t_pid = gettid();
@@ -246,42 +288,61 @@ static void pflush_master(struct thread_info* this) {
 
 	master_wait_workers(this);
 
+	chkpt_done();
+	poll_time = chkpt_poll_time();
+
 	while (!atomic_read(&layer->exit)) {
 		__this->t_state = S_SLEEPING;
 		atomic_set(&STATUS, MASTER_SLEEP);
-		park_master();
+		if (poll_time) {
+			timeout = park_master_timeout(poll_time);
+		} else {
+			park_master();
+			timeout = 0;
+		}
+
+		/* Now that we are running, don't bother to wake us up. */
+		atomic_cmpxchg(&STATUS, MASTER_SLEEP, MASTER_WORK);
 
 		__this->t_state = S_RUNNING;
-		while(need_flush_log() && !atomic_read(&layer->exit)) {
-			oplog_flush(bonsai);
-        }
+		if (unlikely(layer->recovery)) {
+			oplog_recover();
+		}
 
-        if (unlikely(atomic_read(&layer->force_flush))) {
-            oplog_flush(bonsai);
-            atomic_set(&layer->force_flush, 0);
-        }
+		/* A forced checkpoint is done even if we are exiting. */
+		while ((reason = chkpt_decide(timeout)) != CHKPT_NONE &&
+			   (reason == CHKPT_FORCED || !atomic_read(&layer->exit))) {
+			oplog_flush(bonsai);
+			if (reason == CHKPT_FORCED) {
+				atomic_set(&layer->force_flush, 0);
+			}
+			chkpt_done();
+			timeout = 0;
+		}
 	}
 
 	pflush_thread_exit(this);
 }
 
-void wakeup_smo() {
-	if (atomic_read(&SMO_STATUS) != SMO_SLEEP) {
+void wakeup_smo(int part) {
+	/* Order the queued SMOs before the status, see @smo_worker. */
+	smp_mb();
+	if (atomic_read(&SMO_STATUS[part]) != SMO_SLEEP) {
 		return;
 	}
 
-	pthread_mutex_lock(&smo_mutex);
-	atomic_set(&SMO_STATUS, SMO_WORK);
-	pthread_cond_broadcast(&smo_cond);
-	pthread_mutex_unlock(&smo_mutex);
+	pthread_mutex_lock(&smo_mutex[part]);
+	atomic_set(&SMO_STATUS[part], SMO_WORK);
+	pthread_cond_broadcast(&smo_cond[part]);
+	pthread_mutex_unlock(&smo_mutex[part]);
 }
 
-static void park_smo() {
-	pthread_mutex_lock(&smo_mutex);
-	while(atomic_read(&SMO_STATUS) != SMO_WORK) {
-		pthread_cond_wait(&smo_cond, &smo_mutex);
+static void park_smo(int part) {
+	pthread_mutex_lock(&smo_mutex[part]);
+	while(atomic_read(&SMO_STATUS[part]) != SMO_WORK) {
+		pthread_cond_wait(&smo_cond[part], &smo_mutex[part]);
 	}
-	pthread_mutex_unlock(&smo_mutex);
+	pthread_mutex_unlock(&smo_mutex[part]);
 }
 
 static void smo_thread_exit(struct thread_info* thread) {
@@ -297,6 +358,7 @@ static void smo_thread_exit(struct thread_info* thread) {
 
 static void smo_worker(struct thread_info* this) {
 	struct shim_layer* layer = SHIM(bonsai);
+	int part = this->t_id - NUM_PFLUSH_THREAD - 1;
 
     __this = this;
 
@@ -310,12 +372,16 @@ static void smo_worker(struct thread_info* this) {
 
 	while(!atomic_read(&layer->exit)) {
 		this->t_state = S_SLEEPING;
-		atomic_set(&SMO_STATUS, SMO_SLEEP);
-		park_smo();
+		atomic_set(&SMO_STATUS[part], SMO_SLEEP);
+		smp_mb();
+		/* Don't miss the SMOs queued while we were busy. */
+		if (!smo_pending(part)) {
+			park_smo(part);
+		}
 
 		this->t_state = S_RUNNING;
 		if (!atomic_read(&layer->exit)) {
-			do_smo();
+			do_smo(part);
 		}
 	}
 
@@ -430,6 +496,14 @@ int bonsai_pflushd_thread_init() {
         }
     }
 
+    /* Spinning only pays off when nobody waits for our CPU. */
+    pflush_spin = PFLUSH_SPIN;
+    for (i = 0; i < NUM_PFLUSH_THREAD; i++) {
+        if (!bonsai->pflush_threads[i]->t_bind) {
+            pflush_spin = 0;
+        }
+    }
+
     /* create master thread */
     if (pthread_create(&bonsai->tids[bonsai->pflush_master->t_id], NULL, (void *) pflush_master, bonsai->pflush_master) != 0) {
         perror("bonsai create master thread failed");
@@ -456,45 +530,56 @@ int bonsai_pflushd_thread_init() {
 
 int bonsai_smo_thread_init() {
 	struct thread_info* thread;
+	int i;
 
-    pthread_mutex_init(&smo_mutex, NULL);
-	pthread_cond_init(&smo_cond, NULL);
+	for (i = 0; i < NUM_SMO_THREAD; i++) {
+		pthread_mutex_init(&smo_mutex[i], NULL);
+		pthread_cond_init(&smo_cond[i], NULL);
+		atomic_set(&SMO_STATUS[i], SMO_SLEEP);
+	}
 
-	thread = malloc(sizeof(struct thread_info));
-	thread->t_id = atomic_add_return(1, &tids);
-	thread->t_state = S_UNINIT;
-    thread_alloc_cpu(thread, 0);
-	init_workqueue(thread, &thread->t_wq);
+	for (i = 0; i < NUM_SMO_THREAD; i++) {
+		thread = malloc(sizeof(struct thread_info));
+		thread->t_id = atomic_add_return(1, &tids);
+		thread->t_state = S_UNINIT;
+		thread_alloc_cpu(thread, i % NUM_SOCKET);
+		init_workqueue(thread, &thread->t_wq);
 
-    INIT_LIST_HEAD(&thread->list);
-	spin_lock(&bonsai->list_lock);
-	list_add(&thread->list, &bonsai->thread_list);
-	spin_unlock(&bonsai->list_lock);
+		INIT_LIST_HEAD(&thread->list);
+		spin_lock(&bonsai->list_lock);
+		list_add(&thread->list, &bonsai->thread_list);
+		spin_unlock(&bonsai->list_lock);
 
-	bonsai->smo = thread;
+		bonsai->smo[i] = thread;
 
-	if (pthread_create(&bonsai->tids[NUM_PFLUSH_THREAD + 1], NULL,
-		(void*)smo_worker, (void*)bonsai->smo) != 0) {
-			perror("bonsai create thread failed\n");
-		return -ETHREAD;
+		if (pthread_create(&bonsai->tids[NUM_PFLUSH_THREAD + 1 + i], NULL,
+			(void*)smo_worker, (void*)thread) != 0) {
+				perror("bonsai create thread failed\n");
+			return -ETHREAD;
+		}
+		pthread_setname_np(bonsai->tids[NUM_PFLUSH_THREAD + 1 + i], "smo_worker");
 	}
-    pthread_setname_np(bonsai->tids[NUM_PFLUSH_THREAD + 1], "smo_worker");
 	
 	return 0;
 }
 
 int bonsai_smo_thread_exit() {
 	struct shim_layer* layer = SHIM(bonsai);
+	int i;
 
     atomic_set(&layer->exit, 1);
 
-	while (atomic_read(&layer->exit) != 2) {
-		wakeup_smo();
+	while (atomic_read(&layer->exit) != 1 + NUM_SMO_THREAD) {
+		for (i = 0; i < NUM_SMO_THREAD; i++) {
+			wakeup_smo(i);
+		}
 		usleep(10);
 	}
 
-	pthread_join(bonsai->tids[NUM_PFLUSH_THREAD], NULL);
-	free(bonsai->smo);
+	for (i = 0; i < NUM_SMO_THREAD; i++) {
+		pthread_join(bonsai->tids[NUM_PFLUSH_THREAD + 1 + i], NULL);
+		free(bonsai->smo[i]);
+	}
 
 	bonsai_print("smo thread exit\n");
 
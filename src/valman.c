@@ -289,8 +289,10 @@ size_t valman_vpool_dimm_size() {
     return get_dimm_pool_size() * NUM_SOCKET;
 }
 
-void valman_vpool_init() {
-    create_vpool();
+void valman_vpool_init(int format) {
+    if (format) {
+        create_vpool();
+    }
     DATA(bonsai)->vpool = get_vpool();
 }
 
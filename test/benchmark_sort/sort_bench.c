@@ -0,0 +1,103 @@
+/*
+ * Micro-benchmark of the sort phase of a checkpoint: the local sort, and the
+ * local merge of the runs each pflush worker gets from the others.
+ *
+ * Usage: ./sort_bench [nr_logs] [nr_runs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bonsai.h"
+
+void sort_oplogs(struct oplog *oplogs, int nr);
+size_t merge_oplogs(struct oplog *out, struct oplog **starts, const int *cnts, int k);
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The merge collaboratively_sort_logs used to do: a linear scan per log. */
+static void scan_merge(struct oplog *out, struct oplog **starts, const int *cnts, int k, int total) {
+    int curp[k], min_idx, i, j;
+
+    memset(curp, 0, sizeof(curp));
+    for (i = 0; i < total; i++) {
+        min_idx = -1;
+        for (j = 0; j < k; j++) {
+            if (curp[j] < cnts[j] && (min_idx == -1 ||
+                    oplog_cmp(&starts[j][curp[j]], &starts[min_idx][curp[min_idx]]) < 0)) {
+                min_idx = j;
+            }
+        }
+        *out++ = starts[min_idx][curp[min_idx]++];
+    }
+}
+
+static void gen_logs(struct oplog *logs, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        memset(&logs[i], 0, sizeof(logs[i]));
+#ifdef STR_KEY
+        snprintf(logs[i].o_kv.k.key, KEY_LEN, "user%016lx", (unsigned long) random() * random());
+#else
+        *(unsigned long *) logs[i].o_kv.k.key = (unsigned long) random() * random();
+#endif
+        logs[i].o_kv.v = i;
+        logs[i].o_stamp = i;
+        logs[i].o_type = OP_INSERT;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 4000000;
+    int k = argc > 2 ? atoi(argv[2]) : NUM_PFLUSH_WORKER_PER_NODE * NUM_SOCKET;
+    struct oplog *logs, *out_scan, *out_tree, *starts[k];
+    int cnts[k], i;
+    double t0, t_sort, t_scan, t_tree;
+
+    logs = malloc(n * sizeof(*logs));
+    out_scan = malloc(n * sizeof(*logs));
+    out_tree = malloc(n * sizeof(*logs));
+
+    srandom(1);
+    gen_logs(logs, n);
+
+    /* Each run is one worker's share, sorted locally. */
+    t0 = now();
+    for (i = 0; i < k; i++) {
+        starts[i] = logs + (long) n * i / k;
+        cnts[i] = (int) ((long) n * (i + 1) / k - (long) n * i / k);
+        sort_oplogs(starts[i], cnts[i]);
+    }
+    t_sort = now() - t0;
+
+    t0 = now();
+    scan_merge(out_scan, starts, cnts, k, n);
+    t_scan = now() - t0;
+
+    t0 = now();
+    merge_oplogs(out_tree, starts, cnts, k);
+    t_tree = now() - t0;
+
+    if (memcmp(out_scan, out_tree, n * sizeof(*logs))) {
+        fprintf(stderr, "merge results differ\n");
+        return 1;
+    }
+
+    printf("%d logs, %d runs\n", n, k);
+    printf("local sort:       %8.3f ms\n", t_sort * 1e3);
+    printf("scan merge:       %8.3f ms\n", t_scan * 1e3);
+    printf("loser tree merge: %8.3f ms\n", t_tree * 1e3);
+
+    free(logs);
+    free(out_scan);
+    free(out_tree);
+
+    return 0;
+}
@@ -9,6 +9,12 @@
 #define YCSB_WORKLOAD_NAME        "a_str"
 #define YCSB_IS_STRING_KEY        1
 #define YCSB_VAL_LEN              8
+
+/* The DRAM index of bonsai: "masstree" or "art" */
+#define YCSB_BONSAI_INDEX         "masstree"
+
+/* Run the ops in transactions of this many ops, retried till committed. 0 to disable. No scans. */
+#define YCSB_TXN_NR_OP            0
 //#define YCSB_VAL_LEN              16384
 
 #ifdef INTERLEAVED_CPU_NR
@@ -54,6 +60,7 @@ struct bonsai_config {
     int nr_user_cpus;
     int *user_cpus;
     int stm_support;
+    const char *index;
 };
 
 struct pacman_config {
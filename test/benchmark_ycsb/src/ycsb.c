@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -28,55 +29,75 @@ static void *get_val(size_t *len) {
     return valbuf;
 }
 
-static void do_op(struct kvstore *kvstore, void *tcontext, ycsb_decompressor_t *dec, long id) {
-    long i, repeat = 1;
-    int st, ed;
+static void run_op(struct kvstore *kvstore, void *tcontext, ycsb_decompressor_t *dec, long i) {
     enum op_type op;
-    int ret, nr, range;
+    int ret, range;
     uint64_t int_key;
     void *key, *val;
     size_t key_len, val_len;
     uint64_t values[1024];
 
+    if (str_key) {
+        op = ycsb_decompressor_get(dec, &key, &range, i);
+        key_len = STR_KEY_LEN;
+    } else {
+        op = ycsb_decompressor_get(dec, &int_key, &range, i);
+        int_key = __builtin_bswap64(int_key);
+        key = &int_key;
+        key_len = sizeof(unsigned long);
+    }
+
+    switch (op) {
+    case OP_INSERT:
+    case OP_UPDATE:
+        val = get_val(&val_len);
+        ret = kvstore->kv_put(tcontext, key, key_len, val, val_len);
+        assert(ret == 0);
+        break;
+
+    case OP_READ:
+        ret = kvstore->kv_get(tcontext, key, key_len, valres, &val_len);
+        assert(ret == 0);
+        __asm__ volatile("" : : "r"(val_len) : "memory");
+        break;
+
+    case OP_SCAN:
+        kvstore->kv_scan(tcontext, key, key_len, 100, values);
+        break;
+
+    default:
+        assert(0);
+        break;
+    }
+}
+
+static void do_op(struct kvstore *kvstore, void *tcontext, ycsb_decompressor_t *dec, long id) {
+    long i, j, repeat = 1;
+    int st, ed, nr, ret;
+
     nr = ycsb_decompressor_get_nr(dec);
 
     st = 1.0 * id / NUM_THREADS * nr;
     ed = 1.0 * (id + 1) / NUM_THREADS * nr;
 
     while(repeat--) {
-        for (i = st; i < ed; i ++) {
-            if (str_key) {
-                op = ycsb_decompressor_get(dec, &key, &range, i);
-                key_len = STR_KEY_LEN;
-            } else {
-                op = ycsb_decompressor_get(dec, &int_key, &range, i);
-                int_key = __builtin_bswap64(int_key);
-                key = &int_key;
-                key_len = sizeof(unsigned long);
+        if (!YCSB_TXN_NR_OP) {
+            for (i = st; i < ed; i ++) {
+                run_op(kvstore, tcontext, dec, i);
             }
+            continue;
+        }
 
-            switch (op) {
-            case OP_INSERT:
-            case OP_UPDATE:
-                val = get_val(&val_len);
-                ret = kvstore->kv_put(tcontext, key, key_len, val, val_len);
-                assert(ret == 0);
-                break;
-
-            case OP_READ:
-                ret = kvstore->kv_get(tcontext, key, key_len, valres, &val_len);
-                assert(ret == 0);
-                __asm__ volatile("" : : "r"(val_len) : "memory");
-                break;
-
-            case OP_SCAN:
-                kvstore->kv_scan(tcontext, key, key_len, 100, values);
-                break;
-
-            default:
-                assert(0);
-                break;
-            }
+        for (i = st; i < ed; i = j) {
+            /* -EAGAIN: conflicted and rolled back, run it again. */
+            do {
+                kvstore->kv_txn_begin(tcontext);
+                for (j = i; j < ed && j < i + YCSB_TXN_NR_OP; j ++) {
+                    run_op(kvstore, tcontext, dec, j);
+                }
+                ret = kvstore->kv_txn_commit(tcontext);
+            } while (ret == -EAGAIN);
+            assert(ret == 0);
         }
     }
 }
@@ -105,6 +126,7 @@ void run_ycsb(const char *kvlib, int str_key_, int str_val_) {
     if (!strcmp(engine, "bonsai")) {
         struct bonsai_config *c = malloc(sizeof(*c));
         c->stm_support = 0;
+        c->index = YCSB_BONSAI_INDEX;
         conf = c;
     } else if (!strcmp(engine, "pacman")) {
         struct pacman_config *c = malloc(sizeof(*c));